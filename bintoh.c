@@ -1,47 +1,774 @@
 
+//-----------------------------------------------------------------------------
+// bintoh: a binary as bindata[] and bindatalen, to be built into another
+// image
+//
+// bintoh [-w 2|4] [-f h|s|o] [-z] [-t [-A addr]] [-S section] [-a align] [-o out] [-b n] file
+//   -w  element size, 2 for unsigned short (default) or 4 for unsigned int
+//   -z  bindata is the image packed with lz.c, bindatalen still counts
+//       elements of the unpacked image, which is all the decoder needs
+//   -t  the input is a bin, elf or hex with any number of segments, also
+//       emit binsegs[], see below
+//   -A  where a raw binary goes with -t (default 0x08000000)
+//   -f  h a C array (default), s an assembler .incbin wrapper, o an arm
+//       elf relocatable object ready to link
+//   -S  section for s and o (default .rodata)
+//   -a  alignment of bindata for s and o (default 4)
+//   -o  output file (default file.bin.h, .s or .o)
+//   -b  time n conversions against one fprintf() per element, no output
+//
+// the input is mmap()ed and each element formatted with a byte to two
+// hex digits table into a big buffer that goes out in large write()s.
+// any size goes, a short last element is zero padded.  bindatalen counts
+// elements, s and o put it in a word after the data.
+//
+// with -t bindata is the segments back to back, each padded to a
+// halfword with 0xFF, and binsegs[] is a table of words
+//
+//   nsegs
+//   { addr, len, offset, crc } per segment
+//   crc32 per flash page
+//
+// offset is where the segment starts in bindata (each segment is its own
+// lz stream with -z), crc the index of its first page crc.  a segment has
+// one crc for every page it touches, over its own bytes in that page.
+//-----------------------------------------------------------------------------
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lz.h"
+#include "image.h"
+
+#define OUT_SIZE (1<<20)
+
+#define FLASH_PAGE_SIZE 0x400
 
-FILE *fpin;
-FILE *fpout;
+unsigned char hexpair[256][2];
+unsigned char obuf[OUT_SIZE];
+unsigned int olen;
+//-1 throws the output away, for timing
+int fdout;
 
-unsigned short data[1024];
+const unsigned char *bin;
+unsigned int binlen;
+unsigned int width;
+//bindatalen, elements of the image before any packing
+unsigned int elements;
+//bin when it is not the input file as is
+unsigned char *binbuf;
+unsigned int *segtab;
+unsigned int segtabn;
+char *binname;
+char *section;
+unsigned int align;
 
 unsigned int ra,rb;
 
+//-----------------------------------------------------------------------------
+void hex_init ( void )
+{
+    static const char digits[]="0123456789ABCDEF";
+    unsigned int ra;
 
-int main ( int argc, char *argv[] )
+    for(ra=0;ra<256;ra++)
+    {
+        hexpair[ra][0]=digits[ra>>4];
+        hexpair[ra][1]=digits[ra&15];
+    }
+}
+//-----------------------------------------------------------------------------
+int flush_out ( void )
 {
-    if(argc<2) return(1);
-    fpin=fopen(argv[1],"rb");
-    if(fpin==NULL) return(1);
-    sprintf((char *)data,"%s.h",argv[1]);
-    fpout=fopen((char *)data,"wt");
-    if(fpout==NULL) return(1);
+    unsigned int ra;
+    int r;
 
-    rb=fread(data,1,sizeof(data),fpin);
-    fclose(fpin);
-    if(rb>0x400)
+    if(fdout>=0)
     {
-        printf("more than a page\n");
-        return(1);
+        for(ra=0;ra<olen;ra+=r)
+        {
+            r=write(fdout,&obuf[ra],olen-ra);
+            if(r<=0)
+            {
+                fprintf(stderr,"write error\n");
+                return(1);
+            }
+        }
+    }
+    olen=0;
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int put_str ( const char *s )
+{
+    unsigned int len;
+
+    len=strlen(s);
+    if((olen+len)>OUT_SIZE)
+    {
+        if(flush_out()) return(1);
+    }
+    memcpy(&obuf[olen],s,len);
+    olen+=len;
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//anything too big for the buffer goes straight out
+int put_data ( const void *s, unsigned int len )
+{
+    unsigned int ra;
+    int r;
+
+    if((olen+len)>OUT_SIZE)
+    {
+        if(flush_out()) return(1);
+    }
+    if(len<=OUT_SIZE)
+    {
+        memcpy(&obuf[olen],s,len);
+        olen+=len;
+        return(0);
+    }
+    for(ra=0;ra<len;ra+=r)
+    {
+        r=write(fdout,(const unsigned char *)s+ra,len-ra);
+        if(r<=0)
+        {
+            fprintf(stderr,"write error\n");
+            return(1);
+        }
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int put_zeros ( unsigned int len )
+{
+    static const unsigned char zeros[64];
+    unsigned int ra;
+
+    for(;len;len-=ra)
+    {
+        ra=(len>sizeof(zeros))?sizeof(zeros):len;
+        if(put_data(zeros,ra)) return(1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//"0xHHHH,\n" or "0xHHHHHHHH,\n", little endian so the last byte is
+//printed first.  w is a constant at each call so this unrolls.
+static inline unsigned int emit ( unsigned char *o, const unsigned char *p, unsigned int w )
+{
+    unsigned int ra;
+
+    o[0]='0';
+    o[1]='x';
+    for(ra=0;ra<w;ra++)
+    {
+        o[2+(ra<<1)]=hexpair[p[w-1-ra]][0];
+        o[3+(ra<<1)]=hexpair[p[w-1-ra]][1];
+    }
+    o[2+(w<<1)]=',';
+    o[3+(w<<1)]='\n';
+    return(4+(w<<1));
+}
+//-----------------------------------------------------------------------------
+int convert ( void )
+{
+    unsigned int ra;
+    unsigned int full;
+    unsigned int count;
+    unsigned char last[4];
+    char s[64];
+
+    full=binlen/width;
+    count=(binlen+width-1)/width;
+    olen=0;
+    if(put_str("\n")) return(1);
+    if(put_str((width==2)?"const unsigned short bindata[]=\n":"const unsigned int bindata[]=\n")) return(1);
+    if(put_str("{\n")) return(1);
+    for(ra=0;ra<full;)
+    {
+        if(olen>(OUT_SIZE-12))
+        {
+            if(flush_out()) return(1);
+        }
+        if(width==2)
+        {
+            for(;(ra<full)&&(olen<=(OUT_SIZE-12));ra++) olen+=emit(&obuf[olen],&bin[ra<<1],2);
+        }
+        else
+        {
+            for(;(ra<full)&&(olen<=(OUT_SIZE-12));ra++) olen+=emit(&obuf[olen],&bin[ra<<2],4);
+        }
+    }
+    if(count>full)
+    {
+        memset(last,0,sizeof(last));
+        memcpy(last,&bin[full*width],binlen-(full*width));
+        if(olen>(OUT_SIZE-12))
+        {
+            if(flush_out()) return(1);
+        }
+        olen+=emit(&obuf[olen],last,width);
+    }
+    if(put_str("};\n")) return(1);
+    if(width==2) sprintf(s,"unsigned int bindatalen=%u;\n",elements);
+    else         sprintf(s,"#define bindatalen %u\n",elements);
+    if(put_str(s)) return(1);
+    if(segtabn)
+    {
+        if(put_str("const unsigned int binsegs[]=\n{\n")) return(1);
+        for(ra=0;ra<segtabn;ra++)
+        {
+            if(olen>(OUT_SIZE-12))
+            {
+                if(flush_out()) return(1);
+            }
+            //little endian host, same as the target
+            olen+=emit(&obuf[olen],(const unsigned char *)&segtab[ra],4);
+        }
+        if(put_str("};\n")) return(1);
+    }
+    if(put_str("\n")) return(1);
+    return(flush_out());
+}
+//-----------------------------------------------------------------------------
+//"    .byte 0xHH,...\n" 16 to a line
+int put_bytes ( void )
+{
+    unsigned int ra;
+    unsigned char *o;
+
+    for(ra=0;ra<binlen;ra++)
+    {
+        if(olen>(OUT_SIZE-16))
+        {
+            if(flush_out()) return(1);
+        }
+        o=&obuf[olen];
+        if((ra&15)==0)
+        {
+            memcpy(o,"    .byte ",10);
+            o+=10;
+        }
+        o[0]='0';
+        o[1]='x';
+        o[2]=hexpair[bin[ra]][0];
+        o[3]=hexpair[bin[ra]][1];
+        o[4]=(((ra&15)==15)||((ra+1)==binlen))?'\n':',';
+        olen=(o+5)-obuf;
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//the assembler pulls the file in itself, the path has to make sense from
+//where it runs.  a packed image only exists here so it goes in as bytes.
+int convert_asm ( void )
+{
+    unsigned int count;
+    const char *flags;
+    char s[1024];
+
+    count=(binlen+width-1)/width;
+    flags=(strncmp(section,".data",5)==0)?"aw":"a";
+    olen=0;
+    snprintf(s,sizeof(s),
+        "\n"
+        "    .section %s,\"%s\"\n"
+        "    .balign %u\n"
+        "    .globl bindata\n"
+        "    .type bindata,%%object\n"
+        "bindata:\n",
+        section,flags,align);
+    if(put_str(s)) return(1);
+    if(binbuf)
+    {
+        if(put_bytes()) return(1);
+    }
+    else
+    {
+        snprintf(s,sizeof(s),"    .incbin \"%s\"\n",binname);
+        if(put_str(s)) return(1);
+    }
+    snprintf(s,sizeof(s),
+        "    .space %u,0\n"
+        "    .size bindata,.-bindata\n"
+        "\n"
+        "    .balign 4\n"
+        "    .globl bindatalen\n"
+        "    .type bindatalen,%%object\n"
+        "bindatalen:\n"
+        "    .4byte %u\n"
+        "    .size bindatalen,4\n"
+        "\n",
+        (count*width)-binlen,elements);
+    if(put_str(s)) return(1);
+    if(segtabn)
+    {
+        if(put_str("    .globl binsegs\n    .type binsegs,%object\nbinsegs:\n")) return(1);
+        for(count=0;count<segtabn;count++)
+        {
+            snprintf(s,sizeof(s),"    .4byte 0x%08X\n",segtab[count]);
+            if(put_str(s)) return(1);
+        }
+        if(put_str("    .size binsegs,.-binsegs\n\n")) return(1);
+    }
+    return(flush_out());
+}
+//-----------------------------------------------------------------------------
+//an elf32 little endian arm relocatable with one section holding
+//bindata, bindatalen then binsegs, no relocations.  file layout: elf
+//header, the data, symbols, strings, section names, section headers.
+int convert_elf ( void )
+{
+    Elf32_Ehdr eh;
+    Elf32_Shdr sh[6];
+    Elf32_Sym sym[5];
+    static const char strtab[]="\0bindata\0bindatalen\0binsegs";
+    char shstrtab[512];
+    unsigned int count;
+    unsigned int datalen;
+    unsigned int lenoff;
+    unsigned int off;
+    unsigned int nsym;
+    unsigned int strsize;
+    unsigned int shstrlen;
+    unsigned int ra;
+
+    count=(binlen+width-1)/width;
+    datalen=count*width;
+    lenoff=(datalen+3)&(~3);
+    //no table no binsegs symbol
+    nsym=segtabn?5:4;
+    strsize=segtabn?sizeof(strtab):20;
+
+    //names: 1 the section, then .symtab, .strtab, .shstrtab
+    memset(shstrtab,0,sizeof(shstrtab));
+    ra=1;
+    ra+=snprintf(&shstrtab[ra],sizeof(shstrtab)-ra-64,"%s",section)+1;
+    memcpy(&shstrtab[ra],".symtab",8);
+    memcpy(&shstrtab[ra+8],".strtab",8);
+    memcpy(&shstrtab[ra+16],".shstrtab",10);
+    shstrlen=ra+26;
+
+    memset(sh,0,sizeof(sh));
+    off=(sizeof(eh)+align-1)&(~(align-1));
+    sh[1].sh_name=1;
+    sh[1].sh_type=SHT_PROGBITS;
+    sh[1].sh_flags=SHF_ALLOC;
+    if(strncmp(section,".data",5)==0) sh[1].sh_flags|=SHF_WRITE;
+    sh[1].sh_offset=off;
+    sh[1].sh_size=lenoff+4+(segtabn<<2);
+    sh[1].sh_addralign=(align>4)?align:4;
+    off+=sh[1].sh_size;
+    sh[2].sh_name=ra;
+    sh[2].sh_type=SHT_SYMTAB;
+    sh[2].sh_offset=off;
+    sh[2].sh_size=nsym*sizeof(Elf32_Sym);
+    sh[2].sh_link=3;
+    //first global
+    sh[2].sh_info=2;
+    sh[2].sh_addralign=4;
+    sh[2].sh_entsize=sizeof(Elf32_Sym);
+    off+=sh[2].sh_size;
+    sh[3].sh_name=ra+8;
+    sh[3].sh_type=SHT_STRTAB;
+    sh[3].sh_offset=off;
+    sh[3].sh_size=strsize;
+    sh[3].sh_addralign=1;
+    off+=strsize;
+    sh[4].sh_name=ra+16;
+    sh[4].sh_type=SHT_STRTAB;
+    sh[4].sh_offset=off;
+    sh[4].sh_size=shstrlen;
+    sh[4].sh_addralign=1;
+    off+=shstrlen;
+    off=(off+3)&(~3);
+
+    memset(&eh,0,sizeof(eh));
+    memcpy(eh.e_ident,ELFMAG,SELFMAG);
+    eh.e_ident[EI_CLASS]=ELFCLASS32;
+    eh.e_ident[EI_DATA]=ELFDATA2LSB;
+    eh.e_ident[EI_VERSION]=EV_CURRENT;
+    eh.e_type=ET_REL;
+    eh.e_machine=EM_ARM;
+    eh.e_version=EV_CURRENT;
+    eh.e_flags=EF_ARM_EABI_VER5;
+    eh.e_ehsize=sizeof(eh);
+    eh.e_shoff=off;
+    eh.e_shentsize=sizeof(Elf32_Shdr);
+    eh.e_shnum=5;
+    eh.e_shstrndx=4;
+
+    memset(sym,0,sizeof(sym));
+    sym[1].st_info=ELF32_ST_INFO(STB_LOCAL,STT_SECTION);
+    sym[1].st_shndx=1;
+    sym[2].st_name=1;
+    sym[2].st_value=0;
+    sym[2].st_size=datalen;
+    sym[2].st_info=ELF32_ST_INFO(STB_GLOBAL,STT_OBJECT);
+    sym[2].st_shndx=1;
+    sym[3].st_name=9;
+    sym[3].st_value=lenoff;
+    sym[3].st_size=4;
+    sym[3].st_info=ELF32_ST_INFO(STB_GLOBAL,STT_OBJECT);
+    sym[3].st_shndx=1;
+    sym[4].st_name=20;
+    sym[4].st_value=lenoff+4;
+    sym[4].st_size=segtabn<<2;
+    sym[4].st_info=ELF32_ST_INFO(STB_GLOBAL,STT_OBJECT);
+    sym[4].st_shndx=1;
+
+    olen=0;
+    if(put_data(&eh,sizeof(eh))) return(1);
+    if(put_zeros(sh[1].sh_offset-sizeof(eh))) return(1);
+    if(put_data(bin,binlen)) return(1);
+    if(put_zeros(lenoff-binlen)) return(1);
+    //the target is little endian too
+    if(put_data(&elements,4)) return(1);
+    if(put_data(segtab,segtabn<<2)) return(1);
+    if(put_data(sym,nsym*sizeof(Elf32_Sym))) return(1);
+    if(put_data(strtab,strsize)) return(1);
+    if(put_data(shstrtab,shstrlen)) return(1);
+    if(put_zeros(off-(sh[4].sh_offset+shstrlen))) return(1);
+    if(put_data(sh,5*sizeof(Elf32_Shdr))) return(1);
+    return(flush_out());
+}
+//-----------------------------------------------------------------------------
+//the way it used to be done, for the benchmark
+int convert_fprintf ( FILE *fp )
+{
+    unsigned int ra,rb;
+    unsigned int count;
+    unsigned int x;
+
+    count=(binlen+width-1)/width;
+    fprintf(fp,"\n");
+    fprintf(fp,(width==2)?"const unsigned short bindata[]=\n":"const unsigned int bindata[]=\n");
+    fprintf(fp,"{\n");
+    for(ra=0;ra<count;ra++)
+    {
+        x=0;
+        for(rb=0;rb<width;rb++)
+        {
+            if(((ra*width)+rb)<binlen) x|=bin[(ra*width)+rb]<<(rb<<3);
+        }
+        if(width==2) fprintf(fp,"0x%04X,\n",x);
+        else         fprintf(fp,"0x%08X,\n",x);
     }
-    if(rb&1) rb++;
-    rb>>=1;
+    fprintf(fp,"};\n");
+    if(width==2) fprintf(fp,"unsigned int bindatalen=%u;\n",elements);
+    else         fprintf(fp,"#define bindatalen %u\n",elements);
+    fprintf(fp,"\n");
+    fflush(fp);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned long long now_us ( void )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return(((unsigned long long)ts.tv_sec)*1000000ULL+(ts.tv_nsec/1000));
+}
+//-----------------------------------------------------------------------------
+int benchmark ( unsigned int n )
+{
+    unsigned long long t0,t1,t2;
+    unsigned int ra;
+    FILE *fp;
+
+    fp=fopen("/dev/null","wt");
+    if(fp==NULL) return(1);
+    fdout=-1;
+    t0=now_us();
+    for(ra=0;ra<n;ra++) convert();
+    t1=now_us();
+    for(ra=0;ra<n;ra++) convert_fprintf(fp);
+    t2=now_us();
+    fclose(fp);
+    printf("%u bytes, %u byte elements, %u runs\n",binlen,width,n);
+    printf("  table   %8.3f ms per run\n",(t1-t0)/(n*1000.0));
+    printf("  fprintf %8.3f ms per run\n",(t2-t1)/(n*1000.0));
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//pack the zero padded image, bin and binlen become the packed stream
+int pack ( void )
+{
+    unsigned char *raw;
+    unsigned int rawlen;
 
-    fprintf(fpout,"\n");
-    fprintf(fpout,"const unsigned short bindata[]=\n");
-    fprintf(fpout,"{\n");
-    for(ra=0;ra<rb;ra++)
+    rawlen=elements*width;
+    raw=malloc(rawlen+1);
+    binbuf=malloc(LZ_PACK_BOUND(rawlen));
+    if((raw==NULL)||(binbuf==NULL))
     {
-        fprintf(fpout,"0x%04X,\n",data[ra]);
+        fprintf(stderr,"out of memory\n");
+        return(1);
     }
-    fprintf(fpout,"};\n");
-    fprintf(fpout,"unsigned int bindatalen=%u;\n",rb);
-    fprintf(fpout,"\n");
+    memset(raw,0,rawlen);
+    memcpy(raw,bin,binlen);
+    if(binlen) munmap((void *)bin,binlen);
+    bin=binbuf;
+    binlen=lz_pack(binbuf,raw,rawlen);
+    free(raw);
+    printf("%s: %u bytes packed to %u\n",binname,rawlen,binlen);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned int crc32 ( unsigned int crc, const unsigned char *s, unsigned int len )
+{
+    static const unsigned int crctab[16]=
+    {
+        0x00000000,0x1DB71064,0x3B6E20C8,0x26D930AC,
+        0x76DC4190,0x6B6B51F4,0x4DB26158,0x5005713C,
+        0xEDB88320,0xF00F9344,0xD6D6A3E8,0xCB61B38C,
+        0x9B64C2B0,0x86D3D2D4,0xA00AE278,0xBDBDF21C
+    };
 
-    fclose(fpout);
+    while(len--)
+    {
+        crc^=*s++;
+        crc=(crc>>4)^crctab[crc&0xF];
+        crc=(crc>>4)^crctab[crc&0xF];
+    }
+    return(crc);
+}
+//-----------------------------------------------------------------------------
+//bin and binlen become the segments back to back, packed or not, and
+//segtab the table that finds them
+int segments ( struct image *im, int zflag )
+{
+    struct segment *sg;
+    unsigned char *raw;
+    unsigned int *st;
+    unsigned int *crc;
+    unsigned int rawlen;
+    unsigned int npages;
+    unsigned int len;
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int rc;
 
+    rawlen=0;
+    npages=0;
+    for(ra=0;ra<im->nsegs;ra++)
+    {
+        sg=&im->seg[ra];
+        if(sg->addr&1)
+        {
+            fprintf(stderr,"segment at 0x%08X is not halfword aligned\n",sg->addr);
+            return(1);
+        }
+        len=(sg->len+1)&(~1);
+        rawlen+=len;
+        npages+=((sg->addr+len-1)/FLASH_PAGE_SIZE)-(sg->addr/FLASH_PAGE_SIZE)+1;
+    }
+    segtabn=1+(im->nsegs*4)+npages;
+    segtab=malloc(segtabn<<2);
+    raw=malloc(rawlen+4);
+    binbuf=raw;
+    if(zflag) binbuf=malloc(LZ_PACK_BOUND(rawlen)+im->nsegs);
+    if((segtab==NULL)||(raw==NULL)||(binbuf==NULL))
+    {
+        fprintf(stderr,"out of memory\n");
+        return(1);
+    }
+    segtab[0]=im->nsegs;
+    crc=&segtab[1+(im->nsegs*4)];
+    rawlen=0;
+    binlen=0;
+    for(ra=0;ra<im->nsegs;ra++)
+    {
+        sg=&im->seg[ra];
+        len=(sg->len+1)&(~1);
+        memcpy(&raw[rawlen],sg->data,sg->len);
+        if(len>sg->len) raw[rawlen+sg->len]=0xFF;
+        st=&segtab[1+(ra*4)];
+        st[0]=sg->addr;
+        st[1]=len;
+        st[2]=zflag?binlen:rawlen;
+        st[3]=crc-segtab;
+        //one crc per page piece
+        for(rb=0;rb<len;rb+=rc)
+        {
+            rc=FLASH_PAGE_SIZE-((sg->addr+rb)&(FLASH_PAGE_SIZE-1));
+            if(rc>(len-rb)) rc=len-rb;
+            *crc++=~crc32(0xFFFFFFFF,&raw[rawlen+rb],rc);
+        }
+        if(zflag) binlen+=lz_pack(&binbuf[binlen],&raw[rawlen],len);
+        printf("%s: 0x%08X %u bytes",binname,sg->addr,len);
+        if(zflag) printf(" packed to %u",binlen-st[2]);
+        printf("\n");
+        rawlen+=len;
+    }
+    if(zflag) free(raw);
+    else      binlen=rawlen;
+    bin=binbuf;
+    elements=(rawlen+width-1)/width;
     return(0);
 }
+//-----------------------------------------------------------------------------
+void usage ( void )
+{
+    fprintf(stderr,"usage: bintoh [-w 2|4] [-f h|s|o] [-z] [-t [-A addr]] [-S section] [-a align] [-o out] [-b n] file\n");
+}
+//-----------------------------------------------------------------------------
+int main ( int argc, char *argv[] )
+{
+    struct image im;
+    struct stat st;
+    char *outname;
+    unsigned int base;
+    char name[512];
+    unsigned int bench;
+    int format;
+    int zflag;
+    int tflag;
+    int fd;
+    int opt;
+
+    width=2;
+    format='h';
+    section=".rodata";
+    align=4;
+    zflag=0;
+    tflag=0;
+    base=0x08000000;
+    outname=NULL;
+    bench=0;
+    while((opt=getopt(argc,argv,"w:f:ztA:S:a:o:b:h"))!=-1)
+    {
+        switch(opt)
+        {
+            case 'w':
+                width=strtoul(optarg,NULL,0);
+                if((width!=2)&&(width!=4))
+                {
+                    usage();
+                    return(1);
+                }
+                break;
+            case 'f':
+                format=optarg[0];
+                if((format!='h')&&(format!='s')&&(format!='o'))
+                {
+                    usage();
+                    return(1);
+                }
+                break;
+            case 'z':
+                zflag=1;
+                break;
+            case 't':
+                tflag=1;
+                break;
+            case 'A':
+                base=strtoul(optarg,NULL,0);
+                break;
+            case 'S':
+                section=optarg;
+                break;
+            case 'a':
+                align=strtoul(optarg,NULL,0);
+                if((align==0)||(align&(align-1))||(align>4096))
+                {
+                    usage();
+                    return(1);
+                }
+                break;
+            case 'o':
+                outname=optarg;
+                break;
+            case 'b':
+                bench=strtoul(optarg,NULL,0);
+                break;
+            default:
+                usage();
+                return(1);
+        }
+    }
+    if(optind>=argc)
+    {
+        usage();
+        return(1);
+    }
+    binname=argv[optind];
+    if(strlen(section)>256)
+    {
+        usage();
+        return(1);
+    }
+    hex_init();
+    binbuf=NULL;
+    segtabn=0;
+    if(tflag)
+    {
+        if(image_load(&im,argv[optind],base,0)) return(1);
+        ra=segments(&im,zflag);
+        image_free(&im);
+        if(ra) return(1);
+    }
+    else
+    {
+        fd=open(argv[optind],O_RDONLY);
+        if(fd<0)
+        {
+            fprintf(stderr,"%s: cannot open\n",argv[optind]);
+            return(1);
+        }
+        if(fstat(fd,&st))
+        {
+            close(fd);
+            return(1);
+        }
+        binlen=st.st_size;
+        bin=(const unsigned char *)"";
+        if(binlen)
+        {
+            bin=mmap(NULL,binlen,PROT_READ,MAP_PRIVATE,fd,0);
+            if(bin==MAP_FAILED)
+            {
+                fprintf(stderr,"%s: mmap failed\n",argv[optind]);
+                close(fd);
+                return(1);
+            }
+        }
+        close(fd);
+        elements=(binlen+width-1)/width;
+        if(zflag)
+        {
+            if(pack()) return(1);
+        }
+    }
+
+    if(bench) return(benchmark(bench));
+
+    if(outname==NULL)
+    {
+        snprintf(name,sizeof(name),"%s.%c",argv[optind],format);
+        outname=name;
+    }
+    fdout=open(outname,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fdout<0)
+    {
+        fprintf(stderr,"%s: cannot create\n",outname);
+        return(1);
+    }
+    if(format=='s')      ra=convert_asm();
+    else if(format=='o') ra=convert_elf();
+    else                 ra=convert();
+    close(fdout);
+    if(segtabn) free(segtab);
+    if(binbuf) free(binbuf);
+    else if(binlen) munmap((void *)bin,binlen);
+    return(ra);
+}
@@ -1,5 +1,33 @@
 
-#include "flashblink.bin.h"
+//-----------------------------------------------------------------------------
+// sram resident flasher, linked with doflashmap
+//
+// the image comes from flashblink.bin.o built with bintoh -z -t -f o,
+// one lz stream (see lz.h) per segment, each unpacked a flash page at a
+// time into a page buffer and programmed before moving on, so the sram
+// only has to hold the packed image.  a match that reaches back past the
+// page being filled is read from the flash already programmed.  once
+// everything is written every page of every segment is checked against
+// the crc32 bintoh worked out for it.
+//
+// erasing and programming go through flash.c, only the pages the
+// segments cover are erased and any failure is left in flash_result[]
+// against its page.
+//-----------------------------------------------------------------------------
+
+#include "flash.h"
+
+//from flashblink.bin.o, see bintoh.c for the binsegs layout
+extern const unsigned char bindata[];
+extern const unsigned int binsegs[];
+
+struct binseg
+{
+    unsigned int addr;
+    unsigned int len;
+    unsigned int offset;
+    unsigned int crc;
+};
 
 void PUT16 ( unsigned int, unsigned int );
 void PUT32 ( unsigned int, unsigned int );
@@ -8,10 +36,8 @@ unsigned int GET32 ( unsigned int );
 #define RCCBASE   0x40021000
 #define GPIOCBASE 0x40011000
 
-#define FLASH_BASE 0x40022000
-#define FLASH_KEYR (FLASH_BASE+0x04)
-#define FLASH_SR   (FLASH_BASE+0x0C)
-#define FLASH_CR   (FLASH_BASE+0x10)
+//above the code and packed image, below the stack
+#define PAGEBUF    0x20001800
 
 void failed ( int x )
 {
@@ -23,12 +49,110 @@ void failed ( int x )
     PUT32(GPIOCBASE+0x0C,rc);
     while(1) continue;
 }
+static const unsigned int crctab[16]=
+{
+    0x00000000,0x1DB71064,0x3B6E20C8,0x26D930AC,
+    0x76DC4190,0x6B6B51F4,0x4DB26158,0x5005713C,
+    0xEDB88320,0xF00F9344,0xD6D6A3E8,0xCB61B38C,
+    0x9B64C2B0,0x86D3D2D4,0xA00AE278,0xBDBDF21C
+};
+
+//-----------------------------------------------------------------------------
+unsigned int crc_mem ( unsigned int add, unsigned int len )
+{
+    unsigned int crc;
+
+    crc=0xFFFFFFFF;
+    while(len--)
+    {
+        crc^=*(const unsigned char *)add;
+        crc=(crc>>4)^crctab[crc&0xF];
+        crc=(crc>>4)^crctab[crc&0xF];
+        add++;
+    }
+    return(~crc);
+}
+//-----------------------------------------------------------------------------
+//unpack len bytes from src and program them from addr up
+void unlz_flash ( const unsigned char *src, unsigned int addr, unsigned int len )
+{
+    const unsigned char *flash;
+    unsigned char *pbuf;
+    unsigned int pos;
+    unsigned int page;
+    unsigned int match;
+    unsigned int m;
+    unsigned int n;
+
+    flash=(const unsigned char *)addr;
+    pbuf=(unsigned char *)PAGEBUF;
+    //pos counts bytes unpacked, page is where the buffer starts
+    pos=0;
+    page=0;
+    m=0;
+    while(pos<len)
+    {
+        n=*src++;
+        match=n&0x80;
+        if(match)
+        {
+            n=(n&0x7F)+3;
+            m=pos-((src[0]|(src[1]<<8))+1);
+            src+=2;
+        }
+        else
+        {
+            n++;
+        }
+        for(;n;n--)
+        {
+            if(match==0)    pbuf[pos-page]=*src++;
+            else if(m<page) pbuf[pos-page]=flash[m++];
+            else            pbuf[pos-page]=pbuf[(m++)-page];
+            pos++;
+            //segments need not start on a page
+            if(((addr+pos)&(FLASH_PAGE_SIZE-1))==0)
+            {
+                flash_program(addr+page,(const unsigned short *)PAGEBUF,pos-page);
+                page=pos;
+            }
+        }
+    }
+    if(pos>page) flash_program(addr+page,(const unsigned short *)PAGEBUF,pos-page);
+}
+//-----------------------------------------------------------------------------
+//same page pieces bintoh took the crcs over, a mismatch is marked
+//against its page.  a segment outside flash has no pages, main counts
+//it as bad on its own.
+void verify_seg ( const struct binseg *seg )
+{
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int crc;
+
+    if(!flash_in_range(seg->addr,seg->len)) return;
+    crc=seg->crc;
+    for(ra=0;ra<seg->len;ra+=rb)
+    {
+        rb=FLASH_PAGE_SIZE-((seg->addr+ra)&(FLASH_PAGE_SIZE-1));
+        if(rb>(seg->len-ra)) rb=seg->len-ra;
+        if(crc_mem(seg->addr+ra,rb)!=binsegs[crc])
+        {
+            flash_result[(seg->addr+ra-FLASH_START)/FLASH_PAGE_SIZE]|=FP_CRC;
+        }
+        crc++;
+    }
+}
+//-----------------------------------------------------------------------------
 int notmain ( void )
 {
 
     volatile unsigned int ra;
     unsigned int rb;
     unsigned int rc;
+    const struct binseg *seg;
+    unsigned int nsegs;
+    unsigned int bad;
 
 
 
@@ -55,54 +179,30 @@ int notmain ( void )
 
 
 
-    //Check to see if flash is locked
-    rb=GET32(FLASH_CR);
-    if(rb&0x80)
+    //unlock, 1 locked, 2 busy
+    rb=flash_init();
+    if(rb) failed(rb);
+
+    //erase only what each segment covers then program it
+    nsegs=binsegs[0];
+    seg=(const struct binseg *)&binsegs[1];
+    bad=0;
+    for(rb=0;rb<nsegs;rb++)
     {
-        //unlock flash
-        PUT32(FLASH_KEYR,0x45670123);
-        PUT32(FLASH_KEYR,0xCDEF89AB);
-        //see if it worked
-        rb=GET32(FLASH_CR);
-        if(rb&0x80)
+        //nowhere in the table to put it, verify_seg() skips it too
+        if(flash_erase_range(seg[rb].addr,seg[rb].len)&FLASH_ERANGE)
         {
-            failed(1);
+            bad++;
+            continue;
         }
+        unlz_flash(&bindata[seg[rb].offset],seg[rb].addr,seg[rb].len);
     }
 
-    //if it is busy then just give up
-    rb=GET32(FLASH_SR);
-    if(rb&0x1)
-    {
-        failed(2);
-    }
-
-
-    //mass erase
-    PUT32(FLASH_SR,0x0034);
-    PUT32(FLASH_CR,0x0004);
-    PUT32(FLASH_CR,0x0044);
-    while(1)
-    {
-        rb=GET32(FLASH_SR);
-        if((rb&0x21)==0x20) break;
-    }
-    PUT32(FLASH_SR,0x0034);
-    PUT32(FLASH_CR,0x0000);
-
-    //program
-    PUT32(FLASH_SR,0x0034);
-    PUT32(FLASH_CR,0x0001);
-
-    //probably needs to be less than a page
-    for(ra=0;ra<bindatalen;ra++) PUT16(0x08000000+(ra<<1),bindata[ra]);
-    while(1)
-    {
-        rb=GET32(FLASH_SR);
-        if((rb&0x21)==0x20) break;
-    }
-    PUT32(FLASH_SR,0x0034);
-    PUT32(FLASH_CR,0x0000);
+    //verify, no need to ask the host
+    for(rb=0;rb<nsegs;rb++) verify_seg(&seg[rb]);
+    flash_lock();
+    bad+=flash_errors();
+    if(bad) failed(3);
 
 
 
@@ -0,0 +1,287 @@
+
+//-----------------------------------------------------------------------------
+// sram resident flash loader for progstm -F
+//
+// written just above the rom bootloader's variables with Write Memory
+// and started with Go, which takes the stack and entry point from the
+// vector table at the front (vectors.s, linked with fastmap).  the part
+// is moved to 24MHz and USART1 to the baud rate progstm left in the
+// parameter block, then frames are taken in as fast as they come:
+//
+//   0xA5 cmd seq len(2) addr(4) payload(len) crc32(4)
+//
+// everything little endian, the crc covers cmd through the payload.
+// the receiver is polled from every wait loop, flash busy included, so
+// the next frames stream into the ring while this one is programmed.
+// each frame is answered with
+//
+//   0x5A seq status crc32(4) xor
+//
+// progstm keeps a few frames in flight and resends only those answered
+// with a bad crc or not at all.  a write never reprograms a halfword
+// that already holds its value so resent frames are harmless.
+//-----------------------------------------------------------------------------
+
+void PUT16 ( unsigned int, unsigned int );
+void PUT32 ( unsigned int, unsigned int );
+unsigned int GET32 ( unsigned int );
+
+#define RCCBASE     0x40021000
+#define GPIOABASE   0x40010800
+#define USART1BASE  0x40013800
+#define FLASHBASE   0x40022000
+
+#define USART_SR    (USART1BASE+0x00)
+#define USART_DR    (USART1BASE+0x04)
+#define USART_BRR   (USART1BASE+0x08)
+#define USART_CR1   (USART1BASE+0x0C)
+
+#define FLASH_KEYR  (FLASHBASE+0x04)
+#define FLASH_SR    (FLASHBASE+0x0C)
+#define FLASH_CR    (FLASHBASE+0x10)
+#define FLASH_AR    (FLASHBASE+0x14)
+
+#define CLOCK       24000000
+
+#define FLASH_BASE      0x08000000
+#define FLASH_SIZE      0x20000
+#define FLASH_PAGE_SIZE 0x400
+
+//{ baud, flags } left by progstm
+#define FASTPARM    0x20001C00
+#define FLAG_ERASED 0x00000001
+
+#define RING        0x20000C00
+#define RING_MASK   0x0FFF
+
+#define SOF         0xA5
+#define REPLY       0x5A
+#define CMD_WRITE   0x57
+#define CMD_CRC     0x43
+#define FRAME_MAX   1024
+
+#define ST_OK       0
+#define ST_CRC      1
+#define ST_FLASH    2
+#define ST_RANGE    3
+
+static const unsigned int crctab[16]=
+{
+    0x00000000,0x1DB71064,0x3B6E20C8,0x26D930AC,
+    0x76DC4190,0x6B6B51F4,0x4DB26158,0x5005713C,
+    0xEDB88320,0xF00F9344,0xD6D6A3E8,0xCB61B38C,
+    0x9B64C2B0,0x86D3D2D4,0xA00AE278,0xBDBDF21C
+};
+
+static unsigned char *ring;
+static unsigned int head;
+static unsigned int tail;
+static unsigned int erased[(FLASH_SIZE/FLASH_PAGE_SIZE)/32];
+
+//-----------------------------------------------------------------------------
+static unsigned int crc_byte ( unsigned int crc, unsigned int b )
+{
+    crc^=b;
+    crc=(crc>>4)^crctab[crc&0xF];
+    crc=(crc>>4)^crctab[crc&0xF];
+    return(crc);
+}
+//-----------------------------------------------------------------------------
+static void rx_poll ( void )
+{
+    while(GET32(USART_SR)&(1<<5))
+    {
+        ring[head&RING_MASK]=GET32(USART_DR)&0xFF;
+        head++;
+    }
+}
+//-----------------------------------------------------------------------------
+static unsigned int getbyte ( void )
+{
+    while(head==tail) rx_poll();
+    return(ring[(tail++)&RING_MASK]);
+}
+//-----------------------------------------------------------------------------
+static void putbyte ( unsigned int b )
+{
+    while((GET32(USART_SR)&(1<<7))==0) rx_poll();
+    PUT32(USART_DR,b);
+}
+//-----------------------------------------------------------------------------
+static void reply ( unsigned int seq, unsigned int status, unsigned int crc )
+{
+    unsigned int ra;
+    unsigned int x;
+
+    x=REPLY^seq^status;
+    putbyte(REPLY);
+    putbyte(seq);
+    putbyte(status);
+    for(ra=0;ra<4;ra++,crc>>=8)
+    {
+        putbyte(crc&0xFF);
+        x^=crc&0xFF;
+    }
+    putbyte(x);
+}
+//-----------------------------------------------------------------------------
+static unsigned int get16 ( unsigned int add )
+{
+    return((GET32(add&(~3))>>((add&2)<<3))&0xFFFF);
+}
+//-----------------------------------------------------------------------------
+//returns the error bits, PGERR and WRPRTERR
+static unsigned int flash_wait ( void )
+{
+    unsigned int ra;
+
+    while((ra=GET32(FLASH_SR))&1) rx_poll();
+    PUT32(FLASH_SR,ra&0x34);
+    return(ra&0x14);
+}
+//-----------------------------------------------------------------------------
+static unsigned int erase_page ( unsigned int add )
+{
+    unsigned int ra;
+
+    PUT32(FLASH_CR,1<<1);
+    PUT32(FLASH_AR,add);
+    PUT32(FLASH_CR,(1<<1)|(1<<6));
+    ra=flash_wait();
+    PUT32(FLASH_CR,0);
+    return(ra);
+}
+//-----------------------------------------------------------------------------
+//the payload is still in the ring starting at start
+static unsigned int program ( unsigned int add, unsigned int start, unsigned int len )
+{
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int hw;
+
+    if((add&1)||(len&1)||(add<FLASH_BASE)||((add+len)>(FLASH_BASE+FLASH_SIZE))) return(ST_RANGE);
+    if(len==0) return(ST_OK);
+    for(ra=(add-FLASH_BASE)/FLASH_PAGE_SIZE;ra<=((add+len-1-FLASH_BASE)/FLASH_PAGE_SIZE);ra++)
+    {
+        if(erased[ra>>5]&(1<<(ra&31))) continue;
+        if(erase_page(FLASH_BASE+(ra*FLASH_PAGE_SIZE))) return(ST_FLASH);
+        erased[ra>>5]|=1<<(ra&31);
+    }
+    rb=ST_OK;
+    PUT32(FLASH_CR,1<<0);
+    for(ra=0;ra<len;ra+=2)
+    {
+        hw=ring[(start+ra)&RING_MASK]|(ring[(start+ra+1)&RING_MASK]<<8);
+        if(get16(add+ra)==hw) continue;
+        PUT16(add+ra,hw);
+        if(flash_wait()||(get16(add+ra)!=hw))
+        {
+            rb=ST_FLASH;
+            break;
+        }
+    }
+    PUT32(FLASH_CR,0);
+    return(rb);
+}
+//-----------------------------------------------------------------------------
+static unsigned int crc_mem ( unsigned int add, unsigned int len )
+{
+    unsigned int crc;
+
+    crc=0xFFFFFFFF;
+    while(len--)
+    {
+        crc=crc_byte(crc,*(unsigned char *)add);
+        add++;
+        if((len&0xFF)==0) rx_poll();
+    }
+    return(~crc);
+}
+//-----------------------------------------------------------------------------
+static void clock_init ( void )
+{
+    unsigned int ra;
+
+    //hsi/2 x6, 24MHz is as fast as a value line part goes
+    if((GET32(RCCBASE+0x04)&0xC)==0x8) return;
+    ra=GET32(RCCBASE+0x04);
+    ra&=~((0xF<<18)|(1<<16)|(7<<11)|(7<<8)|(0xF<<4)|3);
+    ra|=4<<18;
+    PUT32(RCCBASE+0x04,ra);
+    PUT32(RCCBASE+0x00,GET32(RCCBASE+0x00)|(1<<24));
+    while((GET32(RCCBASE+0x00)&(1<<25))==0) continue;
+    PUT32(RCCBASE+0x04,ra|2);
+    while((GET32(RCCBASE+0x04)&0xC)!=0x8) continue;
+}
+//-----------------------------------------------------------------------------
+static void uart_init ( unsigned int baud )
+{
+    unsigned int ra;
+
+    //port A and USART1 clocks, PA9 TX alternate push-pull, PA10 RX input
+    PUT32(RCCBASE+0x18,GET32(RCCBASE+0x18)|(1<<14)|(1<<2));
+    ra=GET32(GPIOABASE+0x04);
+    ra&=~(0xFF<<4);
+    ra|=0x4B<<4;
+    PUT32(GPIOABASE+0x04,ra);
+    //8E1 like the rom bootloader, M covers the parity bit
+    PUT32(USART_CR1,0);
+    PUT32(USART_BRR,(CLOCK+(baud>>1))/baud);
+    PUT32(USART_CR1,(1<<13)|(1<<12)|(1<<10)|(1<<3)|(1<<2));
+}
+//-----------------------------------------------------------------------------
+int notmain ( void )
+{
+    unsigned char hdr[8];
+    unsigned int ra;
+    unsigned int crc;
+    unsigned int len;
+    unsigned int add;
+    unsigned int start;
+    unsigned int rc;
+
+    ring=(unsigned char *)RING;
+    head=0;
+    tail=0;
+    rc=(GET32(FASTPARM+4)&FLAG_ERASED)?0xFFFFFFFF:0;
+    for(ra=0;ra<((FLASH_SIZE/FLASH_PAGE_SIZE)/32);ra++) erased[ra]=rc;
+    clock_init();
+    uart_init(GET32(FASTPARM+0));
+    PUT32(FLASH_KEYR,0x45670123);
+    PUT32(FLASH_KEYR,0xCDEF89AB);
+
+    while(1)
+    {
+        if(getbyte()!=SOF) continue;
+        crc=0xFFFFFFFF;
+        for(ra=0;ra<8;ra++)
+        {
+            hdr[ra]=getbyte();
+            crc=crc_byte(crc,hdr[ra]);
+        }
+        len=hdr[2]|(hdr[3]<<8);
+        add=hdr[4]|(hdr[5]<<8)|(hdr[6]<<16)|(hdr[7]<<24);
+        //a header this wrong means we are not in step, hunt for SOF
+        if((len>FRAME_MAX)||((hdr[0]!=CMD_WRITE)&&(hdr[0]!=CMD_CRC))) continue;
+        start=tail;
+        for(ra=0;ra<len;ra++) crc=crc_byte(crc,getbyte());
+        rc=0;
+        for(ra=0;ra<4;ra++) rc|=getbyte()<<(ra<<3);
+        if(rc!=(~crc))
+        {
+            reply(hdr[1],ST_CRC,0);
+            continue;
+        }
+        if(hdr[0]==CMD_WRITE)
+        {
+            reply(hdr[1],program(add,start,len),0);
+        }
+        else
+        {
+            rc=0;
+            for(ra=0;ra<len;ra++) rc|=ring[(start+ra)&RING_MASK]<<((ra&3)<<3);
+            reply(hdr[1],ST_OK,crc_mem(add,rc));
+        }
+    }
+    return(0);
+}
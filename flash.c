@@ -0,0 +1,184 @@
+
+//-----------------------------------------------------------------------------
+// flash driver, see flash.h
+//-----------------------------------------------------------------------------
+
+#include "flash.h"
+
+void PUT16 ( unsigned int, unsigned int );
+void PUT32 ( unsigned int, unsigned int );
+unsigned int GET32 ( unsigned int );
+
+#define FLASHBASE   0x40022000
+#define FLASH_KEYR  (FLASHBASE+0x04)
+#define FLASH_SR    (FLASHBASE+0x0C)
+#define FLASH_CR    (FLASHBASE+0x10)
+#define FLASH_AR    (FLASHBASE+0x14)
+
+#define SR_BSY      0x01
+#define SR_FLAGS    0x34
+
+#define CR_PG       0x01
+#define CR_PER      0x02
+#define CR_STRT     0x40
+#define CR_LOCK     0x80
+
+//polls of FLASH_SR, a page erase is the slow one at 20-40ms
+#define FLASH_TIMEOUT 0x200000
+
+unsigned char flash_result[FLASH_PAGES];
+
+//-----------------------------------------------------------------------------
+static unsigned int get16 ( unsigned int add )
+{
+    return((GET32(add&(~3))>>((add&2)<<3))&0xFFFF);
+}
+//-----------------------------------------------------------------------------
+//returns the error bits, PGERR and WRPRTERR, or FP_TIMEOUT
+static unsigned int flash_wait ( void )
+{
+    unsigned int ra;
+    unsigned int rb;
+
+    for(rb=0;rb<FLASH_TIMEOUT;rb++)
+    {
+        ra=GET32(FLASH_SR);
+        if((ra&SR_BSY)==0)
+        {
+            //EOP and the errors are cleared by writing them back
+            PUT32(FLASH_SR,ra&SR_FLAGS);
+            return(ra&(FP_PGERR|FP_WRPRTERR));
+        }
+    }
+    return(FP_TIMEOUT);
+}
+//-----------------------------------------------------------------------------
+//all of addr to addr+len is flash, without wrapping
+unsigned int flash_in_range ( unsigned int addr, unsigned int len )
+{
+    if(addr<FLASH_START) return(0);
+    addr-=FLASH_START;
+    if(addr>=FLASH_SIZE) return(0);
+    if(len>(FLASH_SIZE-addr)) return(0);
+    return(1);
+}
+//-----------------------------------------------------------------------------
+//nothing is known about any page yet, nonzero if the flash would not
+//unlock (1) or is busy with something else (2)
+unsigned int flash_init ( void )
+{
+    unsigned int ra;
+
+    for(ra=0;ra<FLASH_PAGES;ra++) flash_result[ra]=0;
+    if(GET32(FLASH_CR)&CR_LOCK)
+    {
+        PUT32(FLASH_KEYR,0x45670123);
+        PUT32(FLASH_KEYR,0xCDEF89AB);
+        if(GET32(FLASH_CR)&CR_LOCK) return(1);
+    }
+    if(GET32(FLASH_SR)&SR_BSY) return(2);
+    PUT32(FLASH_SR,SR_FLAGS);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+void flash_lock ( void )
+{
+    PUT32(FLASH_CR,CR_LOCK);
+}
+//-----------------------------------------------------------------------------
+//erase one page by number and check it reads back blank
+unsigned int flash_erase_page ( unsigned int page )
+{
+    unsigned int add;
+    unsigned int ra;
+    unsigned int rb;
+
+    if(page>=FLASH_PAGES) return(FLASH_ERANGE);
+    add=FLASH_START+(page*FLASH_PAGE_SIZE);
+    PUT32(FLASH_CR,CR_PER);
+    PUT32(FLASH_AR,add);
+    PUT32(FLASH_CR,CR_PER|CR_STRT);
+    rb=flash_wait();
+    PUT32(FLASH_CR,0);
+    if(rb==0)
+    {
+        for(ra=0;ra<FLASH_PAGE_SIZE;ra+=4)
+        {
+            if(GET32(add+ra)!=0xFFFFFFFF)
+            {
+                rb=FP_VERIFY;
+                break;
+            }
+        }
+    }
+    if(rb==0) flash_result[page]|=FP_ERASED;
+    flash_result[page]|=rb;
+    return(rb);
+}
+//-----------------------------------------------------------------------------
+//erase the pages addr to addr+len touches, each page only the first time
+unsigned int flash_erase_range ( unsigned int addr, unsigned int len )
+{
+    unsigned int ra;
+    unsigned int rb;
+
+    if(len==0) return(0);
+    if(!flash_in_range(addr,len)) return(FLASH_ERANGE);
+    rb=0;
+    for(ra=(addr-FLASH_START)/FLASH_PAGE_SIZE;ra<=((addr+len-1-FLASH_START)/FLASH_PAGE_SIZE);ra++)
+    {
+        if(flash_result[ra]&(FP_ERASED|FP_ERRORS)) continue;
+        rb|=flash_erase_page(ra);
+    }
+    return(rb);
+}
+//-----------------------------------------------------------------------------
+//program len bytes, halfword at a time, each one waited on and read back.
+//a halfword that already holds its value is left alone.  the first
+//failure in a page gives up on the rest of that page.
+unsigned int flash_program ( unsigned int addr, const unsigned short *src, unsigned int len )
+{
+    unsigned int page;
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int rc;
+
+    if(len==0) return(0);
+    if((addr&1)||(len&1)) return(FLASH_ERANGE);
+    if(!flash_in_range(addr,len)) return(FLASH_ERANGE);
+    rc=0;
+    page=FLASH_PAGES;
+    PUT32(FLASH_CR,CR_PG);
+    for(ra=0;ra<len;ra+=2)
+    {
+        if(page!=((addr+ra-FLASH_START)/FLASH_PAGE_SIZE))
+        {
+            page=(addr+ra-FLASH_START)/FLASH_PAGE_SIZE;
+            flash_result[page]|=FP_WRITTEN;
+        }
+        if(flash_result[page]&FP_ERRORS) continue;
+        if(get16(addr+ra)==src[ra>>1]) continue;
+        PUT16(addr+ra,src[ra>>1]);
+        rb=flash_wait();
+        if((rb==0)&&(get16(addr+ra)!=src[ra>>1])) rb=FP_VERIFY;
+        flash_result[page]|=rb;
+        rc|=rb;
+    }
+    PUT32(FLASH_CR,0);
+    return(rc);
+}
+//-----------------------------------------------------------------------------
+//pages that have had anything go wrong
+unsigned int flash_errors ( void )
+{
+    unsigned int ra;
+    unsigned int rb;
+
+    rb=0;
+    for(ra=0;ra<FLASH_PAGES;ra++)
+    {
+        if(flash_result[ra]&FP_ERRORS) rb++;
+    }
+    return(rb);
+}
+//-----------------------------------------------------------------------------
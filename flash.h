@@ -0,0 +1,39 @@
+
+//-----------------------------------------------------------------------------
+// flash driver for the stm32f1 medium density parts, target side
+//
+// pages are erased only when something is about to be written to them
+// and only once, every halfword is waited on and read back.  what
+// happened to each page is kept in flash_result[] so a failure can be
+// pinned to a page, a debugger can read the table from the address in
+// the .list file.
+//-----------------------------------------------------------------------------
+
+#define FLASH_START     0x08000000
+#define FLASH_SIZE      0x20000
+#define FLASH_PAGE_SIZE 0x400
+#define FLASH_PAGES     (FLASH_SIZE/FLASH_PAGE_SIZE)
+
+//flash_result[] bits, PGERR and WRPRTERR are where FLASH_SR has them
+#define FP_ERASED   0x01
+#define FP_WRITTEN  0x02
+#define FP_PGERR    0x04
+#define FP_CRC      0x08
+#define FP_WRPRTERR 0x10
+#define FP_VERIFY   0x40
+#define FP_TIMEOUT  0x80
+#define FP_ERRORS   (FP_PGERR|FP_CRC|FP_WRPRTERR|FP_VERIFY|FP_TIMEOUT)
+
+//returned for an address outside the flash, never in the table
+#define FLASH_ERANGE 0x100
+
+extern unsigned char flash_result[FLASH_PAGES];
+
+unsigned int flash_in_range ( unsigned int addr, unsigned int len );
+unsigned int flash_init ( void );
+void flash_lock ( void );
+unsigned int flash_erase_page ( unsigned int page );
+unsigned int flash_erase_range ( unsigned int addr, unsigned int len );
+unsigned int flash_program ( unsigned int addr, const unsigned short *src, unsigned int len );
+unsigned int flash_errors ( void );
+
@@ -0,0 +1,132 @@
+
+//-----------------------------------------------------------------------------
+// host side of the lz format described in lz.h
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+
+static unsigned int lz_hash[1<<LZ_HASH_BITS];
+
+//-----------------------------------------------------------------------------
+static unsigned int hash3 ( const unsigned char *s )
+{
+    unsigned int ra;
+
+    ra=(s[0]<<16)|(s[1]<<8)|s[2];
+    ra*=2654435761U;
+    return(ra>>(32-LZ_HASH_BITS));
+}
+//-----------------------------------------------------------------------------
+static unsigned int put_literals ( unsigned char *dst, const unsigned char *src, unsigned int len )
+{
+    unsigned int ra;
+    unsigned int out;
+
+    out=0;
+    while(len)
+    {
+        ra=len;
+        if(ra>LZ_MAX_LITERAL) ra=LZ_MAX_LITERAL;
+        dst[out++]=ra-1;
+        memcpy(&dst[out],src,ra);
+        out+=ra;
+        src+=ra;
+        len-=ra;
+    }
+    return(out);
+}
+//-----------------------------------------------------------------------------
+//greedy, one hash probe per position, dst needs LZ_PACK_BOUND(len) bytes
+unsigned int lz_pack ( unsigned char *dst, const unsigned char *src, unsigned int len )
+{
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int cand;
+    unsigned int mlen;
+    unsigned int off;
+    unsigned int lit;
+    unsigned int out;
+
+    memset(lz_hash,0,sizeof(lz_hash));
+    out=0;
+    lit=0;
+    ra=0;
+    while(ra<len)
+    {
+        mlen=0;
+        off=0;
+        if((ra+LZ_MIN_MATCH)<=len)
+        {
+            rb=hash3(&src[ra]);
+            cand=lz_hash[rb];
+            lz_hash[rb]=ra+1;
+            if(cand)
+            {
+                cand--;
+                off=ra-cand;
+                if(off<=LZ_MAX_OFFSET)
+                {
+                    while((mlen<LZ_MAX_MATCH)&&((ra+mlen)<len)&&(src[cand+mlen]==src[ra+mlen])) mlen++;
+                }
+            }
+        }
+        if(mlen<LZ_MIN_MATCH)
+        {
+            ra++;
+            continue;
+        }
+        out+=put_literals(&dst[out],&src[lit],ra-lit);
+        dst[out++]=0x80|(mlen-LZ_MIN_MATCH);
+        dst[out++]=((off-1)>>0)&0xFF;
+        dst[out++]=((off-1)>>8)&0xFF;
+        for(rb=ra+1;(rb<(ra+mlen))&&((rb+LZ_MIN_MATCH)<=len);rb++)
+        {
+            lz_hash[hash3(&src[rb])]=rb+1;
+        }
+        ra+=mlen;
+        lit=ra;
+    }
+    out+=put_literals(&dst[out],&src[lit],len-lit);
+    return(out);
+}
+//-----------------------------------------------------------------------------
+//same loop the target side runs, returns the number of bytes produced
+unsigned int lz_unpack ( unsigned char *dst, const unsigned char *src, unsigned int len )
+{
+    const unsigned char *end;
+    unsigned char *start;
+    unsigned char *m;
+    unsigned int n;
+
+    start=dst;
+    end=src+len;
+    while(src<end)
+    {
+        n=*src++;
+        if(n&0x80)
+        {
+            n=(n&0x7F)+LZ_MIN_MATCH;
+            m=dst-((src[0]|(src[1]<<8))+1);
+            src+=2;
+            while(n--) *dst++=*m++;
+        }
+        else
+        {
+            n++;
+            while(n--) *dst++=*src++;
+        }
+    }
+    return(dst-start);
+}
+//-----------------------------------------------------------------------------
+//bytes the token at src occupies in the compressed stream
+unsigned int lz_token_len ( const unsigned char *src )
+{
+    if(src[0]&0x80) return(3);
+    return(src[0]+2);
+}
+//-----------------------------------------------------------------------------
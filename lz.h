@@ -0,0 +1,24 @@
+
+//-----------------------------------------------------------------------------
+// byte oriented lz77 used for compressed loads
+//
+// token < 0x80  : (token+1) literal bytes follow
+// token >= 0x80 : copy (token&0x7F)+3 bytes from (offset+1) bytes back
+//                 in the output, offset is 16 bits little endian
+//
+// the stream has no header, the decoder just runs to the end of the
+// input, so a stream can be cut into blocks on any token boundary
+//-----------------------------------------------------------------------------
+
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    (0x7F+LZ_MIN_MATCH)
+#define LZ_MAX_LITERAL  0x80
+#define LZ_MAX_OFFSET   0x10000
+
+//worst case is all literals
+#define LZ_PACK_BOUND(x) ((x)+((x)/LZ_MAX_LITERAL)+1)
+
+unsigned int lz_pack ( unsigned char *dst, const unsigned char *src, unsigned int len );
+unsigned int lz_unpack ( unsigned char *dst, const unsigned char *src, unsigned int len );
+unsigned int lz_token_len ( const unsigned char *src );
+
@@ -78,11 +78,16 @@ capitanio.org for original source.
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <libgen.h>
+#include <sys/inotify.h>
 
 // sgutils2 (apt-get install libsgutils2-dev)
 #include <scsi/sg_lib.h>
 #include <scsi/sg_pt.h>
 
+#include "lz.h"
+
 // device access
 #define RDWR        0
 #define RO      1
@@ -1007,18 +1012,255 @@ unsigned int GET32 ( unsigned int addr )
     return(read_uint32(sl->q_buf, 0));
 }
 
+#define SRAM_BASE   0x20000000
+#define SRAM_SIZE   0x2000
+#define STACK_TOP   (SRAM_BASE+SRAM_SIZE)
+//diff granularity, one usb bulk packet
+#define CHUNK       64
+//most one write_mem32 is trusted with on a v1 stlink, the same 1K the
+//lz staging blocks go out in
+#define XFER_MAX    0x400
+
+//compressed load layout, must match unlzstub.c and lzmap
+#define LZSTAGE      0x20001400
+#define LZSTAGE_SIZE 0x400
+#define LZMBOX       0x20001C00
+#define LZSTUB       0x20001C40
+#define LZSTUB_SIZE  0x300
+
+unsigned char image[SRAM_SIZE];
+unsigned char loaded[SRAM_SIZE];
+unsigned int loadedlen;
+unsigned char lzbuf[LZ_PACK_BOUND(SRAM_SIZE)];
+unsigned char lzstub[LZSTUB_SIZE];
+
+//returns the image length rounded up to a word, 0 on error
+unsigned int read_image ( char *name, unsigned char *buf )
+{
+    FILE *fp;
+    unsigned int len;
+
+    fp=fopen(name,"rb");
+    if(fp==NULL)
+    {
+        fprintf(stderr,"Error opening file [%s]\n",name);
+        return(0);
+    }
+    memset(buf,0,SRAM_SIZE);
+    len=fread(buf,1,SRAM_SIZE,fp);
+    if(fgetc(fp)!=EOF)
+    {
+        fprintf(stderr,"Error: [%s] is larger than sram (0x%X)\n",name,SRAM_SIZE);
+        len=0;
+    }
+    fclose(fp);
+    len=(len+3)&(~3);
+    return(len);
+}
+
+//write only the CHUNK sized pieces that differ from what was last
+//loaded, adjacent changed chunks go out together, XFER_MAX at a time
+unsigned int write_changed ( unsigned char *buf, unsigned int len )
+{
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int rc;
+    unsigned int rd;
+    unsigned int total;
+
+    total=0;
+    for(ra=0;ra<len;ra=rb)
+    {
+        for(rb=ra;rb<len;rb+=CHUNK)
+        {
+            rc=len-rb;
+            if(rc>CHUNK) rc=CHUNK;
+            if((rb+rc)>loadedlen) break;
+            if(memcmp(&buf[rb],&loaded[rb],rc)) break;
+        }
+        if(rb>=len) break;
+        ra=rb;
+        for(;rb<len;rb+=CHUNK)
+        {
+            rc=len-rb;
+            if(rc>CHUNK) rc=CHUNK;
+            if(((rb+rc)<=loadedlen)&&(memcmp(&buf[rb],&loaded[rb],rc)==0)) break;
+        }
+        if(rb>len) rb=len;
+        for(rc=ra;rc<rb;rc+=rd)
+        {
+            rd=rb-rc;
+            if(rd>XFER_MAX) rd=XFER_MAX;
+            memcpy(sl->q_buf,&buf[rc],rd);
+            stlink_write_mem32(sl,SRAM_BASE+rc,rd);
+        }
+        total+=rb-ra;
+    }
+    memcpy(loaded,buf,len);
+    loadedlen=len;
+    return(total);
+}
+
+//upload the decompressor stub, start it, then stream the compressed
+//image through the two staging buffers, the next block is written
+//while the stub is still expanding the previous one
+int lz_load ( char *stubname, unsigned char *buf, unsigned int len )
+{
+    FILE *fp;
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int rc;
+    unsigned int rd;
+    unsigned int clen;
+    unsigned int stublen;
+    unsigned int blocks;
+
+    if(len>(LZSTAGE-SRAM_BASE))
+    {
+        fprintf(stderr,"Error: image overlaps the lz staging area (0x%08X)\n",LZSTAGE);
+        return(1);
+    }
+    fp=fopen(stubname,"rb");
+    if(fp==NULL)
+    {
+        fprintf(stderr,"Error opening file [%s]\n",stubname);
+        return(1);
+    }
+    stublen=fread(lzstub,1,sizeof(lzstub),fp);
+    fclose(fp);
+    stublen=(stublen+3)&(~3);
+
+    clen=lz_pack(lzbuf,buf,len);
+    if((lz_unpack(loaded,lzbuf,clen)!=len)||memcmp(loaded,buf,len))
+    {
+        fprintf(stderr,"Error: lz round trip failed\n");
+        return(1);
+    }
+
+    memset(sl->q_buf,0,16);
+    stlink_write_mem32(sl,LZMBOX,16);
+    memcpy(sl->q_buf,lzstub,stublen);
+    stlink_write_mem32(sl,LZSTUB,stublen);
+    stlink_write_reg(sl, STACK_TOP, 13);
+    stlink_write_reg(sl, LZSTUB|1, 15);
+    stlink_write_reg(sl, 0x01000000, 16);
+    stlink_run(sl);
+
+    blocks=0;
+    rb=0;
+    for(ra=0;ra<clen;ra=rc)
+    {
+        //cut on a token boundary, track how much output this block makes
+        rd=0;
+        for(rc=ra;rc<clen;rc+=lz_token_len(&lzbuf[rc]))
+        {
+            if((rc+lz_token_len(&lzbuf[rc])-ra)>LZSTAGE_SIZE) break;
+            if(lzbuf[rc]&0x80) rd+=(lzbuf[rc]&0x7F)+LZ_MIN_MATCH;
+            else               rd+=lzbuf[rc]+1;
+        }
+        while(GET32(LZMBOX+((blocks&1)<<3)+4)) continue;
+        memcpy(sl->q_buf,&lzbuf[ra],rc-ra);
+        stlink_write_mem32(sl,LZSTAGE+((blocks&1)*LZSTAGE_SIZE),(rc-ra+3)&(~3));
+        write_uint32(sl->q_buf+0,SRAM_BASE+rb);
+        write_uint32(sl->q_buf+4,rc-ra);
+        stlink_write_mem32(sl,LZMBOX+((blocks&1)<<3),8);
+        rb+=rd;
+        blocks++;
+    }
+    while(GET32(LZMBOX+4)) continue;
+    while(GET32(LZMBOX+12)) continue;
+    stlink_force_debug(sl);
+
+    memcpy(loaded,buf,len);
+    loadedlen=len;
+    printf("lz 0x%X -> 0x%X bytes in %u blocks\n",len,clen,blocks);
+    return(0);
+}
+
+void start_image ( void )
+{
+    stlink_write_reg(sl, STACK_TOP, 13);
+    stlink_write_reg(sl, SRAM_BASE|1, 15);
+    stlink_write_reg(sl, SRAM_BASE|1, 14);
+    stlink_write_reg(sl, 0x01000000, 16); //xpsr thumb bit
+    stlink_run(sl);
+}
+
+//keep the session open and reload the image every time it is rewritten
+//watching the directory so that replace-by-rename is seen as well
+int watch_image ( char *name )
+{
+    int fd;
+    int len;
+    unsigned int ra;
+    unsigned int rb;
+    char dir[1024];
+    char base[1024];
+    char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    char *p;
+
+    snprintf(dir,sizeof(dir),"%s",name);
+    snprintf(base,sizeof(base),"%s",name);
+    fd=inotify_init();
+    if(fd<0)
+    {
+        perror("inotify_init");
+        return(1);
+    }
+    if(inotify_add_watch(fd,dirname(dir),IN_CLOSE_WRITE|IN_MOVED_TO)<0)
+    {
+        perror("inotify_add_watch");
+        return(1);
+    }
+    p=basename(base);
+    fprintf(stderr,"watching [%s]\n",name);
+    while(1)
+    {
+        len=read(fd,evbuf,sizeof(evbuf));
+        if(len<=0)
+        {
+            perror("inotify read");
+            return(1);
+        }
+        rb=0;
+        for(ra=0;ra<len;ra+=sizeof(struct inotify_event)+ev->len)
+        {
+            ev=(struct inotify_event *)&evbuf[ra];
+            if(ev->len&&(strcmp(ev->name,p)==0)) rb++;
+        }
+        if(rb==0) continue;
+        rb=read_image(name,image);
+        if(rb==0) continue;
+        stlink_force_debug(sl);
+        ra=write_changed(image,rb);
+        start_image();
+        printf("reloaded 0x%X bytes, 0x%X changed\n",rb,ra);
+        fflush(stdout);
+    }
+    return(0);
+}
+
 int main(int argc, char *argv[]) {
     // set scpi lib debug level: 0 for no debug info, 10 for lots
     const int scsi_verbose = 2;
     char *dev_name;
-    FILE *fpbin;
     unsigned int ra;
     unsigned int rb;
+    int watch;
+    char *lzname;
 
+    watch=0;
+    lzname=NULL;
+    for(ra=3;ra<argc;ra++)
+    {
+        if(strcmp(argv[ra],"--watch")==0) watch=1;
+        else if((strcmp(argv[ra],"--lz")==0)&&((ra+1)<argc)) lzname=argv[++ra];
+    }
     if(argc<3)
     {
         fputs(
-            "\nUsage: stlink-access-test /dev/sgX filename.bin\n"
+            "\nUsage: stlink-ramload /dev/sgX filename.bin [--watch] [--lz unlzstub.bin]\n"
                 "\n*** Notice: The stlink firmware violates the USB standard.\n"
                 "*** If you plug-in the discovery's stlink, wait a several\n"
                 "*** minutes to let the kernel driver swallow the broken device.\n"
@@ -1031,12 +1273,8 @@ int main(int argc, char *argv[]) {
     }
     dev_name = argv[1];
 
-    fpbin=fopen(argv[2],"rb");
-    if(fpbin==NULL)
-    {
-        fprintf(stderr,"Error opening file [%s]\n",argv[2]);
-        return EXIT_FAILURE;
-    }
+    rb=read_image(argv[2],image);
+    if(rb==0) return EXIT_FAILURE;
 
 
     fputs("*** stlink access test ***\n", stderr);
@@ -1078,15 +1316,16 @@ int main(int argc, char *argv[]) {
 
 
 //----------------------------------------------------------------------
-    ra=0x20000000;
-    while(1)
+    loadedlen=0;
+    if(lzname)
+    {
+        if(lz_load(lzname,image,rb)) return EXIT_FAILURE;
+    }
+    else
     {
-        if(fread(&rb,1,4,fpbin)==0) break;
-        write_uint32(sl->q_buf, rb);
-        stlink_write_mem32(sl, ra, 4);
-        ra+=4;
+        write_changed(image,rb);
     }
-    printf("0x%08X\n",ra);
+    printf("0x%08X\n",SRAM_BASE+rb);
     for(ra=0x20000000;ra<0x20000010;ra+=4)
     {
         stlink_read_mem32(sl, ra, 4);
@@ -1101,13 +1340,12 @@ int main(int argc, char *argv[]) {
         printf("0x%04X 0x%04X\n",ra,rb);
     }
 
-    stlink_write_reg(sl, 0x20000001, 15);
-    stlink_write_reg(sl, 0x20000001, 14);
+    start_image();
 //----------------------------------------------------------------------
 
 
-    stlink_run(sl);
     stlink_status(sl);
+    if(watch) watch_image(argv[2]);
     //----------------------------------------------------------------------
     // back to mass mode, just in case ...
     stlink_exit_debug_mode(sl);
@@ -0,0 +1,278 @@
+
+//-----------------------------------------------------------------------------
+// firmware images loaded at run time
+//
+// the file is mmap()ed and bin and elf segments point straight into
+// the mapping.  intel hex has to be decoded, its data bytes go into one
+// buffer with a segment per contiguous run of records.  a raw binary
+// is one segment, or with IMAGE_HOLES a segment per run of data so the
+// holes of a progstm -O readout are left alone.
+//-----------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+//-----------------------------------------------------------------------------
+static int add_segment ( struct image *im, unsigned int addr, const unsigned char *data, unsigned int len )
+{
+    if(len==0) return(0);
+    if(im->nsegs>=IMAGE_MAX_SEGMENTS)
+    {
+        fprintf(stderr,"image: more than %u segments\n",IMAGE_MAX_SEGMENTS);
+        return(1);
+    }
+    im->seg[im->nsegs].addr=addr;
+    im->seg[im->nsegs].data=data;
+    im->seg[im->nsegs].len=len;
+    im->nsegs++;
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//32 bit little endian, loadable segments go at their physical address
+static int load_elf ( struct image *im )
+{
+    const unsigned char *p;
+    const Elf32_Ehdr *eh;
+    const Elf32_Phdr *ph;
+    unsigned int ra;
+
+    p=im->map;
+    eh=(const Elf32_Ehdr *)p;
+    if((im->maplen<sizeof(Elf32_Ehdr))||(eh->e_ident[EI_CLASS]!=ELFCLASS32)||(eh->e_ident[EI_DATA]!=ELFDATA2LSB))
+    {
+        fprintf(stderr,"image: not a 32 bit little endian elf\n");
+        return(1);
+    }
+    if((eh->e_machine!=EM_ARM)||(eh->e_type!=ET_EXEC))
+    {
+        fprintf(stderr,"image: not an arm executable elf\n");
+        return(1);
+    }
+    //the program headers are e_phentsize apart, which may be more than
+    //an Elf32_Phdr but never less
+    if((eh->e_phnum!=0)&&(eh->e_phentsize<sizeof(Elf32_Phdr)))
+    {
+        fprintf(stderr,"image: bad elf program header size\n");
+        return(1);
+    }
+    if((eh->e_phoff+((unsigned long long)eh->e_phnum*eh->e_phentsize))>im->maplen)
+    {
+        fprintf(stderr,"image: truncated elf\n");
+        return(1);
+    }
+    for(ra=0;ra<eh->e_phnum;ra++)
+    {
+        ph=(const Elf32_Phdr *)(p+eh->e_phoff+(ra*eh->e_phentsize));
+        if(ph->p_type!=PT_LOAD) continue;
+        if(((unsigned long long)ph->p_offset+ph->p_filesz)>im->maplen)
+        {
+            fprintf(stderr,"image: truncated elf\n");
+            return(1);
+        }
+        if(add_segment(im,ph->p_paddr,p+ph->p_offset,ph->p_filesz)) return(1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+static int hexbyte ( const unsigned char *s )
+{
+    unsigned int ra;
+    unsigned int rb;
+    unsigned int rc;
+
+    rc=0;
+    for(ra=0;ra<2;ra++)
+    {
+        rb=s[ra];
+        if((rb>='0')&&(rb<='9')) rb-='0';
+        else if((rb>='A')&&(rb<='F')) rb-='A'-10;
+        else if((rb>='a')&&(rb<='f')) rb-='a'-10;
+        else return(-1);
+        rc=(rc<<4)|rb;
+    }
+    return(rc);
+}
+//-----------------------------------------------------------------------------
+static int load_hex ( struct image *im )
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    unsigned char rec[256+5];
+    unsigned int upper;
+    unsigned int addr;
+    unsigned int out;
+    unsigned int segstart;
+    unsigned int segaddr;
+    unsigned int ra;
+    unsigned int rc;
+    int rb;
+
+    //a hex record carries at most half its length in data
+    im->hex=malloc((im->maplen>>1)+1);
+    if(im->hex==NULL) return(1);
+    p=im->map;
+    end=p+im->maplen;
+    upper=0;
+    out=0;
+    segstart=0;
+    segaddr=0;
+    while(p<end)
+    {
+        if(*p!=':')
+        {
+            p++;
+            continue;
+        }
+        p++;
+        rb=((end-p)>=2)?hexbyte(p):-1;
+        if((rb<0)||((end-p)<((rb+5)<<1)))
+        {
+            fprintf(stderr,"image: bad hex record\n");
+            return(1);
+        }
+        rc=0;
+        for(ra=0;ra<(unsigned int)(rb+5);ra++,p+=2)
+        {
+            if(hexbyte(p)<0)
+            {
+                fprintf(stderr,"image: bad hex record\n");
+                return(1);
+            }
+            rec[ra]=hexbyte(p);
+            rc+=rec[ra];
+        }
+        if(rc&0xFF)
+        {
+            fprintf(stderr,"image: hex checksum error\n");
+            return(1);
+        }
+        switch(rec[3])
+        {
+            case 0x00:
+                addr=upper+((rec[1]<<8)|rec[2]);
+                if((out==segstart)||(addr!=(segaddr+(out-segstart))))
+                {
+                    if(add_segment(im,segaddr,im->hex+segstart,out-segstart)) return(1);
+                    segstart=out;
+                    segaddr=addr;
+                }
+                memcpy(im->hex+out,&rec[4],rec[0]);
+                out+=rec[0];
+                break;
+            case 0x01:
+                p=end;
+                break;
+            case 0x02:
+                upper=((rec[4]<<8)|rec[5])<<4;
+                break;
+            case 0x04:
+                upper=((rec[4]<<8)|rec[5])<<16;
+                break;
+        }
+    }
+    return(add_segment(im,segaddr,im->hex+segstart,out-segstart));
+}
+//-----------------------------------------------------------------------------
+//a sparse file (progstm -O leaves erased flash as holes) is only its
+//runs of data, the holes are not written.  without SEEK_DATA support
+//the whole file is one run.
+static int load_bin ( struct image *im, int fd, unsigned int base, unsigned int flags )
+{
+    const unsigned char *p;
+    off_t data,hole;
+
+    p=im->map;
+    //any file can be sparse on disk, its holes are data (zeros) unless
+    //asked otherwise
+    if((flags&IMAGE_HOLES)==0) return(add_segment(im,base,p,im->maplen));
+    data=lseek(fd,0,SEEK_DATA);
+    if(data==(off_t)-1)
+    {
+        //all hole
+        if(errno==ENXIO) return(0);
+        return(add_segment(im,base,p,im->maplen));
+    }
+    while(data<im->maplen)
+    {
+        hole=lseek(fd,data,SEEK_HOLE);
+        if((hole==(off_t)-1)||(hole>im->maplen)) hole=im->maplen;
+        if(add_segment(im,base+data,p+data,hole-data)) return(1);
+        data=lseek(fd,hole,SEEK_DATA);
+        if(data==(off_t)-1) break;
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//base is where a raw binary goes, elf and hex carry their own addresses
+int image_load ( struct image *im, char *name, unsigned int base, unsigned int flags )
+{
+    struct stat st;
+    const unsigned char *p;
+    unsigned int ra;
+    int fd;
+
+    memset(im,0,sizeof(struct image));
+    fd=open(name,O_RDONLY);
+    if(fd<0)
+    {
+        fprintf(stderr,"%s: error - %s\n",name,strerror(errno));
+        return(1);
+    }
+    if(fstat(fd,&st)||(st.st_size==0))
+    {
+        fprintf(stderr,"%s: empty or unreadable\n",name);
+        close(fd);
+        return(1);
+    }
+    im->maplen=st.st_size;
+    im->map=mmap(NULL,im->maplen,PROT_READ,MAP_PRIVATE,fd,0);
+    if(im->map==MAP_FAILED)
+    {
+        fprintf(stderr,"%s: mmap error - %s\n",name,strerror(errno));
+        im->map=NULL;
+        close(fd);
+        return(1);
+    }
+    p=im->map;
+    ra=strlen(name);
+    if((im->maplen>=4)&&(memcmp(p,ELFMAG,SELFMAG)==0)) ra=load_elf(im);
+    else if((p[0]==':')||((ra>4)&&(strcasecmp(&name[ra-4],".hex")==0))) ra=load_hex(im);
+    else ra=load_bin(im,fd,base,flags);
+    close(fd);
+    if(ra) return(1);
+    if(im->nsegs==0)
+    {
+        fprintf(stderr,"%s: nothing to load\n",name);
+        return(1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned int image_size ( struct image *im )
+{
+    unsigned int ra;
+    unsigned int rb;
+
+    rb=0;
+    for(ra=0;ra<im->nsegs;ra++) rb+=im->seg[ra].len;
+    return(rb);
+}
+//-----------------------------------------------------------------------------
+void image_free ( struct image *im )
+{
+    if(im->map) munmap(im->map,im->maplen);
+    if(im->hex) free(im->hex);
+    memset(im,0,sizeof(struct image));
+}
+//-----------------------------------------------------------------------------
@@ -0,0 +1,30 @@
+
+//-----------------------------------------------------------------------------
+// firmware images loaded at run time, raw binary, elf or intel hex
+//-----------------------------------------------------------------------------
+
+#define IMAGE_MAX_SEGMENTS 64
+
+struct segment
+{
+    unsigned int addr;
+    unsigned int len;
+    const unsigned char *data;
+};
+
+struct image
+{
+    void *map;
+    unsigned int maplen;
+    unsigned char *hex;
+    unsigned int nsegs;
+    struct segment seg[IMAGE_MAX_SEGMENTS];
+};
+
+//image_load() flags, a raw binary's holes are erased flash, skip them
+#define IMAGE_HOLES 0x0001
+
+int image_load ( struct image *im, char *name, unsigned int base, unsigned int flags );
+void image_free ( struct image *im );
+unsigned int image_size ( struct image *im );
+
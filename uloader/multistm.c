@@ -0,0 +1,450 @@
+
+//-----------------------------------------------------------------------------
+// program a panel of boards at once through their rom bootloaders
+//
+// every port gets its own bootloader state machine in a struct board,
+// all of them are driven from one epoll loop.  a board advances one
+// protocol phase each time its expected response has fully arrived,
+// so slow or dead boards never hold up the others.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "ser.h"
+#include "image.h"
+
+#define ACK             0x79
+#define NACK            0x1F
+
+#define FLASH_BASE      0x08000000
+#define FLASH_PAGE_SIZE 0x400
+#define FLASH_SIZE      0x20000
+
+#define ACK_TIMEOUT     1000
+#define ERASE_TIMEOUT   30000
+
+#define MAX_BOARDS      64
+
+enum
+{
+    S_SYNC,
+    S_GET,
+    S_GET_REST,
+    S_ERASE_CMD,
+    S_ERASE_ARG,
+    S_WRITE_CMD,
+    S_WRITE_ADDR,
+    S_WRITE_DATA,
+    S_READ_CMD,
+    S_READ_ADDR,
+    S_READ_DATA,
+    S_DONE,
+    S_FAILED
+};
+
+struct board
+{
+    char *dev;
+    int fd;
+    unsigned int state;
+    unsigned int extended;
+    unsigned int page;
+    unsigned int pages;
+    unsigned int seg;
+    unsigned int off;
+    unsigned int blen;
+    unsigned char tx[520];
+    unsigned char rx[300];
+    unsigned int rxlen;
+    unsigned int rxwant;
+    unsigned long long deadline;
+    unsigned long long start;
+    unsigned long long end;
+};
+
+struct job
+{
+    struct image image;
+    unsigned int len;
+    unsigned int baud;
+    unsigned int block;
+    int ep;
+    unsigned int nboards;
+    struct board board[MAX_BOARDS];
+};
+
+//-----------------------------------------------------------------------------
+static unsigned long long now_ms ( void )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return(((unsigned long long)ts.tv_sec)*1000ULL+(ts.tv_nsec/1000000));
+}
+//-----------------------------------------------------------------------------
+static void xor_data ( unsigned char *s, unsigned int len )
+{
+    unsigned int ra,rc;
+
+    rc=0;
+    for(ra=0;ra<len;ra++) rc^=s[ra];
+    s[ra]=rc&0xFF;
+}
+//-----------------------------------------------------------------------------
+static void finish ( struct job *j, struct board *b, unsigned int state, char *why )
+{
+    b->state=state;
+    b->end=now_ms();
+    epoll_ctl(j->ep,EPOLL_CTL_DEL,b->fd,NULL);
+    ser_close_fd(b->fd);
+    b->fd=-1;
+    if(state==S_FAILED) printf("%s: failed, %s\n",b->dev,why);
+    else                printf("%s: done in %llu ms\n",b->dev,b->end-b->start);
+}
+//-----------------------------------------------------------------------------
+//send txlen bytes of b->tx and arm the wait for rxwant bytes back
+static void phase ( struct job *j, struct board *b, unsigned int state, unsigned int txlen, unsigned int rxwant, unsigned int ms )
+{
+    b->state=state;
+    b->rxlen=0;
+    b->rxwant=rxwant;
+    b->deadline=now_ms()+ms;
+    if(ser_write_fd(b->fd,b->tx,txlen)) finish(j,b,S_FAILED,"write error");
+}
+//-----------------------------------------------------------------------------
+static void command ( struct job *j, struct board *b, unsigned int state, unsigned int cmd )
+{
+    b->tx[0]=cmd;
+    b->tx[1]=cmd^0xFF;
+    phase(j,b,state,2,1,ACK_TIMEOUT);
+}
+//-----------------------------------------------------------------------------
+static void address ( struct job *j, struct board *b, unsigned int state, unsigned int add )
+{
+    b->tx[0]=(add>>24)&0xFF;
+    b->tx[1]=(add>>16)&0xFF;
+    b->tx[2]=(add>> 8)&0xFF;
+    b->tx[3]=(add>> 0)&0xFF;
+    xor_data(b->tx,4);
+    phase(j,b,state,5,1,ACK_TIMEOUT);
+}
+//-----------------------------------------------------------------------------
+//move on to the pages of the next flash segment once the current run
+//is erased, then start writing
+static void next_erase ( struct job *j, struct board *b )
+{
+    const struct segment *seg;
+
+    while((b->pages==0)&&(b->seg<j->image.nsegs))
+    {
+        seg=&j->image.seg[b->seg++];
+        //only segments wholly in flash, sram is never erased
+        if((seg->addr<FLASH_BASE)||((seg->addr-FLASH_BASE)>=FLASH_SIZE)) continue;
+        if(seg->len>(FLASH_SIZE-(seg->addr-FLASH_BASE))) continue;
+        b->page=(seg->addr-FLASH_BASE)/FLASH_PAGE_SIZE;
+        b->pages=((seg->addr-FLASH_BASE+seg->len-1)/FLASH_PAGE_SIZE)-b->page+1;
+    }
+    if(b->pages==0)
+    {
+        b->seg=0;
+        b->off=0;
+        command(j,b,S_WRITE_CMD,0x31);
+        return;
+    }
+    //Erase page numbers are one byte, past 255 they would wrap around
+    if(!b->extended&&((b->page+b->pages)>256))
+    {
+        finish(j,b,S_FAILED,"pages past 255 need Extended Erase");
+        return;
+    }
+    command(j,b,S_ERASE_CMD,b->extended?0x44:0x43);
+}
+//-----------------------------------------------------------------------------
+static void erase_arg ( struct job *j, struct board *b )
+{
+    unsigned int ra;
+    unsigned int rc;
+
+    rc=b->pages;
+    if(b->extended)
+    {
+        if(rc>250) rc=250;
+        b->tx[0]=((rc-1)>>8)&0xFF;
+        b->tx[1]=((rc-1)>>0)&0xFF;
+        for(ra=0;ra<rc;ra++)
+        {
+            b->tx[2+(ra<<1)]=((b->page+ra)>>8)&0xFF;
+            b->tx[3+(ra<<1)]=((b->page+ra)>>0)&0xFF;
+        }
+        xor_data(b->tx,2+(rc<<1));
+        phase(j,b,S_ERASE_ARG,3+(rc<<1),1,ERASE_TIMEOUT);
+    }
+    else
+    {
+        if(rc>255) rc=255;
+        b->tx[0]=rc-1;
+        for(ra=0;ra<rc;ra++) b->tx[1+ra]=(b->page+ra)&0xFF;
+        xor_data(b->tx,1+rc);
+        phase(j,b,S_ERASE_ARG,2+rc,1,ERASE_TIMEOUT);
+    }
+    b->page+=rc;
+    b->pages-=rc;
+}
+//-----------------------------------------------------------------------------
+//a complete response is in b->rx, move the board on to its next phase
+static void step ( struct job *j, struct board *b )
+{
+    const struct segment *seg;
+    unsigned int ra;
+
+    if((b->rx[0]!=ACK)&&!((b->state==S_SYNC)&&(b->rx[0]==NACK)))
+    {
+        finish(j,b,S_FAILED,"nack");
+        return;
+    }
+    seg=&j->image.seg[b->seg];
+    switch(b->state)
+    {
+        case S_SYNC:
+            command(j,b,S_GET,0x00);
+            b->rxwant=2;
+            break;
+        case S_GET:
+            b->rxwant=b->rx[1]+4;
+            b->state=S_GET_REST;
+            break;
+        case S_GET_REST:
+            //the list ends in an ACK too
+            if(b->rx[b->rx[1]+3]!=ACK)
+            {
+                finish(j,b,S_FAILED,"bad Get response");
+                return;
+            }
+            for(ra=0;ra<b->rx[1];ra++) if(b->rx[3+ra]==0x44) b->extended=1;
+            b->seg=0;
+            b->pages=0;
+            next_erase(j,b);
+            break;
+        case S_ERASE_CMD:
+            erase_arg(j,b);
+            break;
+        case S_ERASE_ARG:
+            next_erase(j,b);
+            break;
+        case S_WRITE_CMD:
+            address(j,b,S_WRITE_ADDR,seg->addr+b->off);
+            break;
+        case S_WRITE_ADDR:
+            b->blen=seg->len-b->off;
+            if(b->blen>j->block) b->blen=j->block;
+            memcpy(&b->tx[1],seg->data+b->off,b->blen);
+            for(ra=b->blen;ra&3;ra++) b->tx[1+ra]=0xFF;
+            b->tx[0]=ra-1;
+            xor_data(b->tx,ra+1);
+            phase(j,b,S_WRITE_DATA,ra+2,1,ACK_TIMEOUT);
+            break;
+        case S_WRITE_DATA:
+            b->off+=b->blen;
+            if(b->off>=seg->len)
+            {
+                b->seg++;
+                b->off=0;
+            }
+            if(b->seg<j->image.nsegs) command(j,b,S_WRITE_CMD,0x31);
+            else
+            {
+                b->seg=0;
+                command(j,b,S_READ_CMD,0x11);
+            }
+            break;
+        case S_READ_CMD:
+            address(j,b,S_READ_ADDR,seg->addr+b->off);
+            break;
+        case S_READ_ADDR:
+            b->blen=seg->len-b->off;
+            if(b->blen>256) b->blen=256;
+            ra=(b->blen+3)&(~3);
+            b->tx[0]=ra-1;
+            b->tx[1]=b->tx[0]^0xFF;
+            phase(j,b,S_READ_DATA,2,ra+1,ACK_TIMEOUT);
+            break;
+        case S_READ_DATA:
+            if(memcmp(&b->rx[1],seg->data+b->off,b->blen))
+            {
+                finish(j,b,S_FAILED,"verify error");
+                break;
+            }
+            b->off+=b->blen;
+            if(b->off>=seg->len)
+            {
+                b->seg++;
+                b->off=0;
+            }
+            if(b->seg<j->image.nsegs) command(j,b,S_READ_CMD,0x11);
+            else finish(j,b,S_DONE,NULL);
+            break;
+    }
+}
+//-----------------------------------------------------------------------------
+static void receive ( struct job *j, struct board *b )
+{
+    int r;
+
+    //an earlier event in the same batch may have finished it
+    if(b->fd<0) return;
+    r=read(b->fd,&b->rx[b->rxlen],b->rxwant-b->rxlen);
+    if(r<=0)
+    {
+        if((r<0)&&((errno==EAGAIN)||(errno==EINTR))) return;
+        finish(j,b,S_FAILED,"read error");
+        return;
+    }
+    b->rxlen+=r;
+    //anything but an ACK up front is final, no need to wait for the rest
+    if((b->rx[0]!=ACK)&&(b->state!=S_SYNC))
+    {
+        finish(j,b,S_FAILED,"nack");
+        return;
+    }
+    if(b->rxlen==b->rxwant) step(j,b);
+}
+//-----------------------------------------------------------------------------
+static int run ( struct job *j )
+{
+    struct epoll_event ev[MAX_BOARDS];
+    struct board *b;
+    unsigned long long now;
+    unsigned long long next;
+    unsigned int ra;
+    unsigned int active;
+    int n;
+    int rn;
+
+    j->ep=epoll_create1(0);
+    if(j->ep<0)
+    {
+        perror("epoll_create1");
+        return(1);
+    }
+    for(ra=0;ra<j->nboards;ra++)
+    {
+        b=&j->board[ra];
+        b->start=now_ms();
+        b->fd=ser_open_fd(b->dev,j->baud);
+        if(b->fd<0)
+        {
+            b->state=S_FAILED;
+            b->end=b->start;
+            continue;
+        }
+        ev[0].events=EPOLLIN;
+        ev[0].data.ptr=b;
+        epoll_ctl(j->ep,EPOLL_CTL_ADD,b->fd,&ev[0]);
+        b->tx[0]=0x7F;
+        phase(j,b,S_SYNC,1,1,ACK_TIMEOUT);
+    }
+    while(1)
+    {
+        now=now_ms();
+        next=now+ERASE_TIMEOUT;
+        active=0;
+        for(ra=0;ra<j->nboards;ra++)
+        {
+            b=&j->board[ra];
+            if((b->state==S_DONE)||(b->state==S_FAILED)) continue;
+            if(now>=b->deadline)
+            {
+                finish(j,b,S_FAILED,"timeout");
+                continue;
+            }
+            if(b->deadline<next) next=b->deadline;
+            active++;
+        }
+        if(active==0) break;
+        n=epoll_wait(j->ep,ev,MAX_BOARDS,(int)(next-now));
+        if(n<0)
+        {
+            if(errno==EINTR) continue;
+            perror("epoll_wait");
+            return(1);
+        }
+        for(rn=0;rn<n;rn++) receive(j,(struct board *)ev[rn].data.ptr);
+    }
+    close(j->ep);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+static void usage ( void )
+{
+    printf("usage: multistm [-b baud] [-w bytes] [-a addr] image device [device ...]\n");
+    printf("  image is a raw .bin, an elf or an intel .hex file\n");
+    printf("  -b  baud rate (default 57600)\n");
+    printf("  -w  bytes per Write Memory, 4 to 256 (default 256)\n");
+    printf("  -a  load address of a raw binary (default 0x%08X)\n",FLASH_BASE);
+}
+//-----------------------------------------------------------------------------
+int main ( int argc, char *argv[] )
+{
+    struct job *j;
+    unsigned long long start;
+    unsigned long long ms;
+    unsigned int ra;
+    unsigned int ok;
+    unsigned int base;
+    int opt;
+
+    j=calloc(1,sizeof(struct job));
+    if(j==NULL) return(1);
+    j->baud=57600;
+    j->block=256;
+    base=FLASH_BASE;
+    while((opt=getopt(argc,argv,"b:w:a:h"))!=-1)
+    {
+        switch(opt)
+        {
+            case 'b':
+                j->baud=strtoul(optarg,NULL,0);
+                break;
+            case 'w':
+                j->block=strtoul(optarg,NULL,0)&(~3);
+                if((j->block<4)||(j->block>256))
+                {
+                    usage();
+                    return(1);
+                }
+                break;
+            case 'a':
+                base=strtoul(optarg,NULL,0);
+                break;
+            default:
+                usage();
+                return(1);
+        }
+    }
+    if(((optind+1)>=argc)||((argc-optind-1)>MAX_BOARDS))
+    {
+        usage();
+        return(1);
+    }
+    if(image_load(&j->image,argv[optind],base,0)) return(1);
+    j->len=image_size(&j->image);
+    for(ra=optind+1;ra<(unsigned int)argc;ra++) j->board[j->nboards++].dev=argv[ra];
+
+    start=now_ms();
+    if(run(j)) return(1);
+    ms=now_ms()-start;
+
+    ok=0;
+    for(ra=0;ra<j->nboards;ra++) if(j->board[ra].state==S_DONE) ok++;
+    printf("%u of %u boards programmed in %llu ms",ok,j->nboards,ms);
+    if(ms) printf(", %llu bytes/s aggregate",(((unsigned long long)ok)*j->len*1000ULL)/ms);
+    printf("\n");
+    return(ok!=j->nboards);
+}
+//-----------------------------------------------------------------------------
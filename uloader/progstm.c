@@ -6,18 +6,164 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "ser.h"
 
-#include "blinker.bin.h"
+#include "image.h"
+#include "stats.h"
 
 unsigned int seq;
 unsigned int ra,rb,rc,rd;
 unsigned int addr;
 
+//medium density value line, 1K pages
+#define FLASH_BASE      0x08000000
+#define FLASH_PAGE_SIZE 0x400
+//flash size in K, in system memory
+#define FLASH_SIZE_REG  0x1FFFF7E0
+#define FLASH_SIZE_DEF  0x20000
+//96 bit unique id, what the journal is kept by
+#define UID_REG         0x1FFFF7E8
+#define UID_LEN         12
+
+//ms to wait for a response, erase acks only after the erase is done
+#define ACK_TIMEOUT     1000
+#define ERASE_TIMEOUT   30000
+
+//transaction results
+#define XA_OK           0
+#define XA_NACK         1
+#define XA_TIMEOUT      2
+#define XA_GARBAGE      3
+#define XACT_RETRIES    3
+
+//what follows the last ACK of a command
+#define R_NONE          0
+//rxlen bytes, Read Memory
+#define R_DATA          1
+//a count n, n+1 bytes and an ACK, Get and Get ID
+#define R_COUNTED       2
+//rxlen bytes and an ACK, Get Version
+#define R_FIXED         3
+//a second ACK once the work is done, Readout Unprotect
+#define R_ACK           4
+
+//write_retry(), block_state() and verify_image() results
+#define MAX_REWRITES    4
+#define WB_OK           0
+#define WB_FAILED       1
+#define WB_DIRTY        2
+#define WB_ERASED       3
+
+#define MAX_BAUDS       16
+
+//1 reports phases, 2 every command, 0 (-q) only errors and the summary
+#define INFO(...)  do { if(verbose>0) printf(__VA_ARGS__); } while(0)
+#define TRACE(...) do { if(verbose>1) printf(__VA_ARGS__); } while(0)
+
+//sram flash loader, see ../fastload.c
+#define FAST_BASE       0x20000200
+#define FAST_PARM       0x20001C00
+#define FAST_ERASED     0x00000001
+#define FAST_SOF        0xA5
+#define FAST_REPLY      0x5A
+#define FAST_WRITE      0x57
+#define FAST_CRC        0x43
+#define FAST_BLOCK      1024
+//frames in flight, all of them have to fit the loader's 4K ring
+#define FAST_WINDOW     3
+#define FAST_TIMEOUT    1000
+#define FAST_RETRIES    8
+
+//bootloader capabilities seen per chip id, one line each
+#define CAPS_FILE       ".progstm_caps"
+
+//progress of an unfinished session per chip id: id, image hash and a
+//character per flash page, '.' untouched, 'e' erased, 'w' written
+#define JOURNAL_FILE    ".progstm_journal"
+#define MAX_PAGES       2048
+#define NO_PAGE         0xFFFFFFFF
+
+//console output is gathered into writes this big, or whatever there is
+//once CON_FLUSH ms have passed since the last one
+#define CON_BUF         (1<<16)
+#define CON_FLUSH       200
+
+char *ser_dev;
+unsigned int bauds[MAX_BAUDS];
+unsigned int nbauds;
+unsigned int baud;
+unsigned int dtr_reset;
+unsigned int latency_count;
+unsigned int write_block;
+unsigned int mass_erase;
+unsigned int image_base;
+unsigned int image_flags;
+unsigned int verbose;
+unsigned int json;
+unsigned int go_after;
+unsigned int erase_bytes;
+//added to every deadline, twice the link's round trip over tcp
+unsigned int link_ms;
+char *readout_name;
+int readout_fd;
+unsigned int readout_bytes;
+unsigned char page_buf[FLASH_PAGE_SIZE];
+unsigned char ff_buf[FLASH_PAGE_SIZE];
+char *image_name;
+struct image image;
+
+unsigned char bootcmd[256];
+unsigned int nbootcmd;
+unsigned int bootver;
+unsigned int optbyte[2];
+unsigned int chip_id;
+char chip_uid[(UID_LEN<<1)+1];
+unsigned int no_cache;
+char caps_path[512];
+unsigned int fast_baud;
+char *fast_stub;
+unsigned int fast_resent;
+unsigned int fast_stub_len;
+unsigned int fresh;
+char journal_path[512];
+unsigned int image_hash;
+char page_state[MAX_PAGES+1];
+unsigned int console_baud;
+char *capture_name;
+volatile sig_atomic_t console_stop;
+unsigned char con_buf[CON_BUF];
+unsigned int con_used;
+int con_fd;
+
+struct fast_slot
+{
+    unsigned int busy;
+    unsigned int seq;
+    unsigned int addr;
+    unsigned int len;
+    unsigned int tries;
+    unsigned long long sent;
+    unsigned char frame[FAST_BLOCK+16];
+};
+struct fast_slot fslot[FAST_WINDOW];
+
 unsigned char sdata[512];
 unsigned char udata[512];
 unsigned char rdata[5000];
+unsigned char xbuf[600];
+unsigned char xrx[300];
+
+struct xphase
+{
+    const unsigned char *data;
+    unsigned int len;
+};
 
 //-----------------------------------------------------------------------------
 void xor_data ( unsigned char *sdata, unsigned int len )
@@ -32,509 +178,1671 @@ void xor_data ( unsigned char *sdata, unsigned int len )
 int detect_chip ( void )
 {
     unsigned int rb;
+    unsigned long long t;
 
-    printf("detect_chip()\n");
+    TRACE("detect_chip()\n");
+    t=stats_now();
     sdata[0]=0x7F;
     ser_senddata(sdata,1);
-    while(1)
+    rb=ser_recv(rdata,1,ACK_TIMEOUT+link_ms);
+    if(rb==0)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]==0x79)
-            {
-                ser_dump(rb);
-                break;
-            }
-            printf("detect_chip error %u 0x%02X\n",rb,rdata[0]);
-            return(1);
-        }
+        INFO("detect_chip timeout\n");
+        return(1);
+    }
+    //a NACK means the bootloader already locked onto this rate
+    if((rdata[0]!=0x79)&&(rdata[0]!=0x1F))
+    {
+        printf("detect_chip error %u 0x%02X\n",rb,rdata[0]);
+        return(1);
     }
-    printf("chip found\n");
+    INFO("chip found\n");
+    stats_cmd(0x7F,stats_now()-t);
     return(0);
 }
 //-----------------------------------------------------------------------------
-int get ( void )
+//try the configured rates fastest first, the rom measures the first
+//0x7F it sees, so each fallback needs a fresh bootloader (-r strobes
+//DTR for that, otherwise reset the board by hand between attempts)
+int negotiate ( void )
 {
-    unsigned int ra,rb,rc;
+    unsigned int ra;
 
-    printf("get()\n");
-    sdata[0]=0x00;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-
-    while(1)
+    for(ra=0;ra<nbauds;ra++)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
+        INFO("trying %u baud\n",bauds[ra]);
+        if(ser_setbaud(bauds[ra])) continue;
+        if(dtr_reset) strobedtr();
+        ser_flush();
+        if(detect_chip()==0)
         {
-            if(rdata[0]!=0x79)
-            {
-                printf("go error\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            if(rb>1)
-            {
-                if(rb==(rdata[1]+4))
-                {
-                    ser_dump(rb);
-                    break;
-                }
-            }
+            baud=bauds[ra];
+            INFO("using %u baud\n",baud);
+            return(0);
         }
     }
-    printf("%02X %02X\n",rdata[0],rdata[1]);
-    printf("%02X bootloader version\n",rdata[2]);
-    for(ra=0;ra<rdata[1];ra++)
+    printf("no response at any baud rate\n");
+    return(1);
+}
+//-----------------------------------------------------------------------------
+//the table driven part, every bootloader command is the command byte
+//and its complement, then phases each sent with a checksum (the
+//complement for a single byte, xor for more) and ACKed, then maybe a
+//reply.  the last ACK of an erase or unprotect takes as long as the
+//flash work.  a transient error is retried from the top, after getting
+//the bootloader back to its command prompt if it was left part way
+//through something.
+static const struct cmd_info
+{
+    unsigned int cmd;
+    unsigned int reply;
+    unsigned int ms;
+    unsigned int retry;
+} cmd_info[]=
+{
+    { 0x00, R_COUNTED, ACK_TIMEOUT,   1 },
+    { 0x01, R_FIXED,   ACK_TIMEOUT,   1 },
+    { 0x02, R_COUNTED, ACK_TIMEOUT,   1 },
+    { 0x11, R_DATA,    ACK_TIMEOUT,   1 },
+    //a lost second ACK may mean the application is already running
+    { 0x21, R_NONE,    ACK_TIMEOUT,   0 },
+    //write_retry() reads back before it tries again
+    { 0x31, R_NONE,    ACK_TIMEOUT,   0 },
+    { 0x43, R_NONE,    ERASE_TIMEOUT, 1 },
+    { 0x44, R_NONE,    ERASE_TIMEOUT, 1 },
+    { 0x92, R_ACK,     ERASE_TIMEOUT, 0 },
+};
+
+static const char *xa_name[]={ "ok","nack","timeout","garbage" };
+
+//-----------------------------------------------------------------------------
+int wait_ack ( unsigned int ms )
+{
+    if(ser_recv(xrx,1,ms+link_ms)!=1) return(XA_TIMEOUT);
+    if(xrx[0]==0x79) return(XA_OK);
+    if(xrx[0]==0x1F) return(XA_NACK);
+    return(XA_GARBAGE);
+}
+//-----------------------------------------------------------------------------
+//let the line go quiet, then feed 0x7F until the bootloader answers:
+//a phase it was part way through fills up and is NACKed, at the
+//command prompt 0x7F 0x7F is a bad complement.  then quiet again.
+int resync ( void )
+{
+    unsigned int ra;
+
+    while(ser_recv(xrx,sizeof(xrx),20+link_ms)) continue;
+    xbuf[0]=0x7F;
+    for(ra=0;ra<300;ra++)
     {
-        switch(rdata[ra+3])
-        {
-            default: printf("%02X unknown\n",rdata[ra+3]); break;
-            case 0x00: printf("%02X get\n",rdata[ra+3]); break;
-            case 0x01: printf("%02X get version and read protection status\n",rdata[ra+3]); break;
-            case 0x02: printf("%02X get ID\n",rdata[ra+3]); break;
-            case 0x11: printf("%02X Read Memory\n",rdata[ra+3]); break;
-            case 0x21: printf("%02X Go\n",rdata[ra+3]); break;
-            case 0x31: printf("%02X Write Memory\n",rdata[ra+3]); break;
-            case 0x43: printf("%02X Erase\n",rdata[ra+3]); break;
-            case 0x44: printf("%02X Extended Erase\n",rdata[ra+3]); break;
-            case 0x63: printf("%02X Write Protect\n",rdata[ra+3]); break;
-            case 0x73: printf("%02X Write Unprotect\n",rdata[ra+3]); break;
-            case 0x82: printf("%02X Readout Protect\n",rdata[ra+3]); break;
-            case 0x92: printf("%02X Readout Unprotect\n",rdata[ra+3]); break;
-        }
+        ser_senddata(xbuf,1);
+        if(ser_recv(xrx,1,10+link_ms)) break;
     }
-    if(rdata[rdata[1]+3]!=0x79)
+    while(ser_recv(xrx,sizeof(xrx),20+link_ms)) continue;
+    if(ra==300)
     {
-        printf("go ack error\n");
+        printf("resync failed\n");
         return(1);
     }
     return(0);
 }
 //-----------------------------------------------------------------------------
-int getverpstat ( void )
+int xact_once ( const struct cmd_info *ci, const struct xphase *ph, unsigned int nph, unsigned char *rx, unsigned int rxlen )
 {
     unsigned int ra,rb,rc;
+    int r;
 
-    printf("getverpstat()\n");
-    sdata[0]=0x01;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    xbuf[0]=ci->cmd;
+    xbuf[1]=ci->cmd^0xFF;
+    ser_senddata(xbuf,2);
+    stats_roundtrip();
+    r=wait_ack(((nph==0)&&(ci->reply==R_NONE))?ci->ms:ACK_TIMEOUT);
+    if(r) return(r);
+    for(ra=0;ra<nph;ra++)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
+        memcpy(xbuf,ph[ra].data,ph[ra].len);
+        if(ph[ra].len==1) xbuf[1]=xbuf[0]^0xFF;
+        else
         {
-            if(rdata[0]!=0x79)
-            {
-                printf("getverpstat error\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            if(rb==5)
-            {
-                ser_dump(rb);
-                break;
-            }
+            rc=0;
+            for(rb=0;rb<ph[ra].len;rb++) rc^=xbuf[rb];
+            xbuf[rb]=rc;
         }
+        ser_senddata(xbuf,ph[ra].len+1);
+        stats_roundtrip();
+        r=wait_ack(((ra==(nph-1))&&(ci->reply==R_NONE))?ci->ms:ACK_TIMEOUT);
+        if(r) return(r);
     }
-    if((rdata[0]!=0x79)||(rdata[4]!=0x79))
+    switch(ci->reply)
     {
-        printf("ack error\n");
-        return(1);
+        case R_DATA:
+            //with no buffer the data is left in the receive ring
+            if(rx==NULL)
+            {
+                if(ser_peek(rxlen,ACK_TIMEOUT)==NULL) return(XA_TIMEOUT);
+            }
+            else if(ser_recv(rx,rxlen,ACK_TIMEOUT)!=rxlen) return(XA_TIMEOUT);
+            return(XA_OK);
+        case R_COUNTED:
+            if(ser_recv(rx,1,ACK_TIMEOUT)!=1) return(XA_TIMEOUT);
+            if(ser_recv(rx+1,rx[0]+1,ACK_TIMEOUT)!=(rx[0]+1U)) return(XA_TIMEOUT);
+            return(wait_ack(ACK_TIMEOUT));
+        case R_FIXED:
+            if(ser_recv(rx,rxlen,ACK_TIMEOUT)!=rxlen) return(XA_TIMEOUT);
+            return(wait_ack(ACK_TIMEOUT));
+        case R_ACK:
+            return(wait_ack(ci->ms));
     }
-    printf("0x%02X version\n",rdata[1]);
-    printf("0x%02X read prot disables\n",rdata[2]);
-    printf("0x%02X read prot enables\n",rdata[3]);
-    return(0);
+    return(XA_OK);
 }
 //-----------------------------------------------------------------------------
-int getid ( void )
+//returns XA_OK or why the last attempt failed, the bootloader is back
+//at its command prompt either way (unless it is gone for good)
+int transact ( unsigned int cmd, const struct xphase *ph, unsigned int nph, unsigned char *rx, unsigned int rxlen )
 {
-    unsigned int ra,rb,rc;
+    const struct cmd_info *ci;
+    unsigned long long t;
+    unsigned int ra;
+    int r;
 
-    printf("getid()\n");
-    sdata[0]=0x02;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    for(ci=cmd_info;ci<&cmd_info[sizeof(cmd_info)/sizeof(cmd_info[0])];ci++)
+    {
+        if(ci->cmd==cmd) break;
+    }
+    if(ci==&cmd_info[sizeof(cmd_info)/sizeof(cmd_info[0])])
+    {
+        printf("no table entry for command 0x%02X\n",cmd);
+        return(XA_NACK);
+    }
+    for(ra=0;;ra++)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
+        t=stats_now();
+        r=xact_once(ci,ph,nph,rx,rxlen);
+        if(r==XA_OK)
         {
-            if(rb==5)
-            {
-                ser_dump(rb);
-                break;
-            }
+            stats_cmd(cmd,stats_now()-t);
+            return(XA_OK);
         }
+        //even a NACK may have come part way through a phase, with the
+        //rest of it still to be taken as commands
+        if(resync()) return(r);
+        if((!ci->retry)||(ra>=XACT_RETRIES)) return(r);
+        stats_retry(cmd);
+        INFO("command 0x%02X %s, retrying\n",cmd,xa_name[r]);
     }
-    for(ra=0;ra<5;ra++) printf("%02X ",rdata[ra]); printf("\n");
+}
+//-----------------------------------------------------------------------------
+void put_addr ( unsigned char *d, unsigned int add )
+{
+    d[0]=(add>>24)&0xFF;
+    d[1]=(add>>16)&0xFF;
+    d[2]=(add>> 8)&0xFF;
+    d[3]=(add>> 0)&0xFF;
+}
+//-----------------------------------------------------------------------------
+int get ( void )
+{
+    unsigned int ra;
+    int r;
 
+    TRACE("get()\n");
+    r=transact(0x00,NULL,0,rdata,0);
+    if(r)
+    {
+        printf("get %s\n",xa_name[r]);
+        return(1);
+    }
+    TRACE("%02X bootloader version\n",rdata[1]);
+    for(ra=0;ra<rdata[0];ra++)
+    {
+        switch(rdata[ra+2])
+        {
+            default: TRACE("%02X unknown\n",rdata[ra+2]); break;
+            case 0x00: TRACE("%02X get\n",rdata[ra+2]); break;
+            case 0x01: TRACE("%02X get version and read protection status\n",rdata[ra+2]); break;
+            case 0x02: TRACE("%02X get ID\n",rdata[ra+2]); break;
+            case 0x11: TRACE("%02X Read Memory\n",rdata[ra+2]); break;
+            case 0x21: TRACE("%02X Go\n",rdata[ra+2]); break;
+            case 0x31: TRACE("%02X Write Memory\n",rdata[ra+2]); break;
+            case 0x43: TRACE("%02X Erase\n",rdata[ra+2]); break;
+            case 0x44: TRACE("%02X Extended Erase\n",rdata[ra+2]); break;
+            case 0x63: TRACE("%02X Write Protect\n",rdata[ra+2]); break;
+            case 0x73: TRACE("%02X Write Unprotect\n",rdata[ra+2]); break;
+            case 0x82: TRACE("%02X Readout Protect\n",rdata[ra+2]); break;
+            case 0x92: TRACE("%02X Readout Unprotect\n",rdata[ra+2]); break;
+        }
+    }
+    bootver=rdata[1];
+    nbootcmd=rdata[0];
+    memcpy(bootcmd,&rdata[2],nbootcmd);
     return(0);
 }
 //-----------------------------------------------------------------------------
-int read_mem_32 ( unsigned int add, unsigned int *data )
+int has_cmd ( unsigned int cmd )
 {
-    unsigned int ra,rb,rc;
+    unsigned int ra;
 
-    *data=0;
+    for(ra=0;ra<nbootcmd;ra++) if(bootcmd[ra]==cmd) return(1);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int getverpstat ( void )
+{
+    int r;
 
-    printf("read_mem_32(0x%08X)\n",add);
-    sdata[0]=0x11;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    TRACE("getverpstat()\n");
+    r=transact(0x01,NULL,0,rdata,3);
+    if(r)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("read_mem_32 error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(1); //rb should be a 1!
-            break;
-        }
+        printf("getverpstat %s\n",xa_name[r]);
+        return(1);
     }
-    sdata[0]=(add>>24)&0xFF;
-    sdata[1]=(add>>16)&0xFF;
-    sdata[2]=(add>> 8)&0xFF;
-    sdata[3]=(add>> 0)&0xFF;
+    TRACE("0x%02X version\n",rdata[0]);
+    TRACE("0x%02X read prot disables\n",rdata[1]);
+    TRACE("0x%02X read prot enables\n",rdata[2]);
+    optbyte[0]=rdata[1];
+    optbyte[1]=rdata[2];
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int getid ( void )
+{
+    int r;
 
-    sdata[4]=sdata[0]^sdata[1]^sdata[2]^sdata[3];
+    TRACE("getid()\n");
+    r=transact(0x02,NULL,0,rdata,0);
+    if(r)
+    {
+        printf("getid %s\n",xa_name[r]);
+        return(1);
+    }
+    chip_id=(rdata[1]<<8)|rdata[2];
+    TRACE("0x%04X chip id\n",chip_id);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//line format: id bootver opt0 opt1 ncmds cmd ..., all hex
+int caps_load ( unsigned int id )
+{
+    FILE *fp;
+    char line[1024];
+    char *s;
+    unsigned int ra,rb;
 
-    //xor_data(sdata,4);
-    ser_senddata(sdata,5);
-    while(1)
+    if(caps_path[0]==0) return(1);
+    fp=fopen(caps_path,"rt");
+    if(fp==NULL) return(1);
+    while(fgets(line,sizeof(line),fp))
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("read_mem_32 error 2\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(1); //rb should be a 1!
-            break;
-        }
+        s=line;
+        if(strtoul(s,&s,16)!=id) continue;
+        bootver=strtoul(s,&s,16);
+        optbyte[0]=strtoul(s,&s,16);
+        optbyte[1]=strtoul(s,&s,16);
+        rb=strtoul(s,&s,16);
+        if(rb>sizeof(bootcmd)) break;
+        for(ra=0;ra<rb;ra++) bootcmd[ra]=strtoul(s,&s,16);
+        nbootcmd=rb;
+        fclose(fp);
+        INFO("cached capabilities for chip 0x%04X, bootloader 0x%02X\n",id,bootver);
+        return(0);
     }
-    sdata[0]=4-1;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    fclose(fp);
+    return(1);
+}
+//-----------------------------------------------------------------------------
+int caps_save ( unsigned int id )
+{
+    FILE *fp;
+    FILE *fpo;
+    char line[1024];
+    char tmp[520];
+    unsigned int ra;
+
+    if(caps_path[0]==0) return(1);
+    snprintf(tmp,sizeof(tmp),"%s.%u",caps_path,(unsigned int)getpid());
+    fpo=fopen(tmp,"wt");
+    if(fpo==NULL) return(1);
+    fp=fopen(caps_path,"rt");
+    if(fp)
     {
-        rb=ser_copystring(rdata);
-        if(rb==5)
+        while(fgets(line,sizeof(line),fp))
         {
-            ser_dump(rb);
-            break;
+            if(strtoul(line,NULL,16)!=id) fputs(line,fpo);
         }
+        fclose(fp);
     }
-    if(rdata[0]!=0x79)
+    fprintf(fpo,"%04X %02X %02X %02X %02X",id,bootver,optbyte[0],optbyte[1],nbootcmd);
+    for(ra=0;ra<nbootcmd;ra++) fprintf(fpo," %02X",bootcmd[ra]);
+    fprintf(fpo,"\n");
+    fclose(fpo);
+    return(rename(tmp,caps_path));
+}
+//-----------------------------------------------------------------------------
+//the commands programming cannot do without
+int check_caps ( void )
+{
+    if(!has_cmd(0x11)||!has_cmd(0x31)||(!has_cmd(0x43)&&!has_cmd(0x44)))
     {
-        printf("read_mem_32 error 3\n");
-        for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
+        printf("bootloader lacks read, write or erase\n");
         return(1);
     }
-    //for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-    *data =rdata[4]; *data<<=8;
-    *data|=rdata[3]; *data<<=8;
-    *data|=rdata[2]; *data<<=8;
-    *data|=rdata[1];
-    printf("=0x%08X\n",*data);
     return(0);
 }
 //-----------------------------------------------------------------------------
-int write_mem_32 ( unsigned int add, unsigned int data )
+int read_mem_32 ( unsigned int add, unsigned int *data )
 {
-    unsigned int ra,rb,rc;
+    unsigned char a[4];
+    unsigned char n[1];
+    struct xphase ph[2]={ { a,4 }, { n,1 } };
+    int r;
 
-    printf("write_mem_32(0x%08X,0x%08X)\n",add,data);
-    sdata[0]=0x31;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    *data=0;
+    TRACE("read_mem_32(0x%08X)\n",add);
+    put_addr(a,add);
+    n[0]=4-1;
+    r=transact(0x11,ph,2,rdata,4);
+    if(r)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("write_mem_32 error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
-        }
+        printf("read_mem_32(0x%08X) %s\n",add,xa_name[r]);
+        return(1);
     }
-    sdata[0]=(add>>24)&0xFF;
-    sdata[1]=(add>>16)&0xFF;
-    sdata[2]=(add>> 8)&0xFF;
-    sdata[3]=(add>> 0)&0xFF;
-    xor_data(sdata,4);
-    ser_senddata(sdata,5);
-    while(1)
+    *data=rdata[0]|(rdata[1]<<8)|(rdata[2]<<16)|(rdata[3]<<24);
+    TRACE("=0x%08X\n",*data);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//the data is left in the receive ring, the caller ser_dump()s it
+unsigned char *read_mem_ptr ( unsigned int add, unsigned int len )
+{
+    unsigned char a[4];
+    unsigned char n[1];
+    struct xphase ph[2]={ { a,4 }, { n,1 } };
+    int r;
+
+    if((len==0)||(len>256))
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("write_mem_32 error 2\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
-        }
+        printf("read_mem bad length %u\n",len);
+        return(NULL);
     }
-    sdata[0]=4-1;
-    sdata[1]=(data>> 0)&0xFF;
-    sdata[2]=(data>> 8)&0xFF;
-    sdata[3]=(data>>16)&0xFF;
-    sdata[4]=(data>>24)&0xFF;
-    xor_data(sdata,5);
-    ser_senddata(sdata,6);
-    while(1)
+    TRACE("read_mem(0x%08X,%u)\n",add,len);
+    put_addr(a,add);
+    n[0]=len-1;
+    r=transact(0x11,ph,2,NULL,len);
+    if(r)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("write_mem_32 error 3\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
-        }
+        printf("read_mem(0x%08X,%u) %s\n",add,len,xa_name[r]);
+        return(NULL);
     }
+    return(ser_peek(len,0));
+}
+//-----------------------------------------------------------------------------
+int read_mem ( unsigned int add, unsigned char *data, unsigned int len )
+{
+    unsigned char *rp;
 
+    rp=read_mem_ptr(add,len);
+    if(rp==NULL) return(1);
+    memcpy(data,rp,len);
+    ser_dump(len);
     return(0);
 }
 //-----------------------------------------------------------------------------
-int erase_page ( unsigned int page )
+//the chip id only says which part it is, this one tells two boards apart
+int read_uid ( void )
 {
-    unsigned int ra,rb,rc;
+    unsigned char id[UID_LEN];
+    unsigned int ra;
 
-    printf("erase_page(%u)\n",page);
-    sdata[0]=0x43;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    if(read_mem(UID_REG,id,UID_LEN)) return(1);
+    for(ra=0;ra<UID_LEN;ra++) sprintf(&chip_uid[ra<<1],"%02X",id[ra]);
+    TRACE("%s unique id\n",chip_uid);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//up to 256 bytes per Write Memory, short blocks are padded with 0xFF
+//out to a multiple of 4 bytes.  one attempt, see write_retry()
+int write_mem ( unsigned int add, const unsigned char *data, unsigned int len )
+{
+    unsigned char a[4];
+    struct xphase ph[2]={ { a,4 }, { sdata,0 } };
+    int r;
+
+    if((len==0)||(len>256))
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("erase_page error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
-        }
+        printf("write_mem bad length %u\n",len);
+        return(XA_NACK);
     }
-    sdata[0]=1; //one page
-    sdata[1]=page&0xFF; //page number
-    xor_data(sdata,2);
-    ser_senddata(sdata,3);
-    while(1)
+    TRACE("write_mem(0x%08X,%u)\n",add,len);
+    put_addr(a,add);
+    memcpy(&sdata[1],data,len);
+    for(;len&3;len++) sdata[1+len]=0xFF;
+    sdata[0]=len-1;
+    ph[1].len=len+1;
+    r=transact(0x31,ph,2,NULL,0);
+    if(r) INFO("write_mem(0x%08X,%u) %s\n",add,len,xa_name[r]);
+    return(r);
+}
+//-----------------------------------------------------------------------------
+int write_mem_32 ( unsigned int add, unsigned int data )
+{
+    unsigned char d[4];
+
+    TRACE("write_mem_32(0x%08X,0x%08X)\n",add,data);
+    d[0]=(data>> 0)&0xFF;
+    d[1]=(data>> 8)&0xFF;
+    d[2]=(data>>16)&0xFF;
+    d[3]=(data>>24)&0xFF;
+    return(write_mem(add,d,4)?1:0);
+}
+//-----------------------------------------------------------------------------
+//write a block and make sure it took.  when the ACK does not come back
+//read a block back: WB_OK if it holds data already, WB_ERASED if it is
+//all 0xFF, WB_DIRTY for anything in between
+int block_state ( unsigned int add, const unsigned char *data, unsigned int len )
+{
+    unsigned int ra,rb;
+    unsigned char *rp;
+    int r;
+
+    rb=(len+3)&(~3);
+    rp=read_mem_ptr(add,rb);
+    if(rp==NULL) return(WB_FAILED);
+    if(memcmp(rp,data,len)==0) r=WB_OK;
+    else
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("erase_page error 2\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
-        }
+        for(ra=0;ra<len;ra++) if(rp[ra]!=0xFF) break;
+        r=(ra<len)?WB_DIRTY:WB_ERASED;
     }
-    printf("erased\n");
-    return(0);
+    ser_dump(rb);
+    return(r);
 }
 //-----------------------------------------------------------------------------
-int erase_flash ( void )
+//all of add to add+len is flash, sram and anything else is not erased
+int in_flash ( unsigned int add, unsigned int len )
 {
-    unsigned int ra,rb,rc;
+    if(add<FLASH_BASE) return(0);
+    add-=FLASH_BASE;
+    if(add>=FLASH_SIZE_DEF) return(0);
+    if(len>(FLASH_SIZE_DEF-add)) return(0);
+    return(1);
+}
+//-----------------------------------------------------------------------------
+//the block is read back first: if it is there only the ACK was lost, if
+//it is still erased it is sent again, anything in between can only be
+//fixed by erasing its page (WB_DIRTY, the caller does that)
+int write_retry ( unsigned int add, const unsigned char *data, unsigned int len )
+{
+    unsigned int ra;
+    int r;
 
-    printf("erase_flash()\n");
-    sdata[0]=0x43;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    for(ra=0;;ra++)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
+        if(write_mem(add,data,len)==XA_OK) return(WB_OK);
+        if(ra>=XACT_RETRIES)
         {
-            if(rdata[0]!=0x79)
-            {
-                printf("erase_flash error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
+            printf("write_mem(0x%08X,%u) failed\n",add,len);
+            return(WB_FAILED);
         }
-    }
-    sdata[0]=0xFF; //one page
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
-    {
-        rb=ser_copystring(rdata);
-        if(rb)
+        stats_retry(0x31);
+        r=block_state(add,data,len);
+        if(r==WB_FAILED) return(r);
+        if(r==WB_OK)
         {
-            if(rdata[0]!=0x79)
-            {
-                printf("erase_flash error 2\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-            ser_dump(rb); //rb should be a 1!
-            break;
+            INFO("block at 0x%08X was written, only the ACK went missing\n",add);
+            return(WB_OK);
+        }
+        //sram takes a plain overwrite
+        if((r==WB_DIRTY)&&in_flash(add,len))
+        {
+            INFO("block at 0x%08X is half written\n",add);
+            return(WB_DIRTY);
         }
+        INFO("writing block at 0x%08X again\n",add);
     }
-    printf("erased\n");
-    return(0);
 }
 //-----------------------------------------------------------------------------
-int go ( unsigned int add )
+//erase a run of pages with as few commands as possible, Extended Erase
+//(0x44, 16 bit page numbers) if get() saw it, else Erase (0x43)
+int erase_pages ( unsigned int page, unsigned int count )
 {
-    unsigned int ra,rb,rc;
+    unsigned int ra,rc;
+    unsigned int cmd;
+    unsigned int max;
+    struct xphase ph[1]={ { sdata,0 } };
+    int r;
 
-    printf("go(0x%08X)\n",add);
-    sdata[0]=0x21;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    if(has_cmd(0x44))
     {
-        rb=ser_copystring(rdata);
-        if(rb)
-        {
-            if(rdata[0]!=0x79)
-            {
-                printf("go error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]); printf("\n");
-            ser_dump(rb); //rb should be a 1!
-            break;
-        }
+        cmd=0x44;
+        max=250;
     }
-    sdata[0]=(add>>24)&0xFF;
-    sdata[1]=(add>>16)&0xFF;
-    sdata[2]=(add>> 8)&0xFF;
-    sdata[3]=(add>> 0)&0xFF;
-    xor_data(sdata,4);
-    ser_senddata(sdata,5);
-    while(1)
+    else
     {
-        rb=ser_copystring(rdata);
-        if(rb)
+        cmd=0x43;
+        max=255;
+        //page numbers are one byte, past 255 they would wrap around
+        if((page+count)>256)
         {
-            if(rdata[0]!=0x79)
-            {
-                printf("go error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
-            }
-for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]); printf("\n");
-            ser_dump(rb); //rb should be a 1!
-            break;
+            printf("erase_pages(%u,%u) needs Extended Erase, not offered\n",page,count);
+            return(1);
         }
     }
-    while(1)
+    while(count)
     {
-        rb=ser_copystring(rdata);
-        if(rb)
+        rc=count;
+        if(rc>max) rc=max;
+        TRACE("erase_pages(%u,%u) 0x%02X\n",page,rc,cmd);
+        if(cmd==0x44)
         {
-            if(rdata[0]!=0x79)
+            sdata[0]=((rc-1)>>8)&0xFF;
+            sdata[1]=((rc-1)>>0)&0xFF;
+            for(ra=0;ra<rc;ra++)
             {
-                printf("go error 1\n");
-                for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
-                return(1);
+                sdata[2+(ra<<1)]=((page+ra)>>8)&0xFF;
+                sdata[3+(ra<<1)]=((page+ra)>>0)&0xFF;
             }
-for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]); printf("\n");
-            ser_dump(rb); //rb should be a 1!
-            break;
+            ph[0].len=2+(rc<<1);
+        }
+        else
+        {
+            sdata[0]=rc-1;
+            for(ra=0;ra<rc;ra++) sdata[1+ra]=(page+ra)&0xFF;
+            ph[0].len=1+rc;
         }
+        r=transact(cmd,ph,1,NULL,0);
+        if(r)
+        {
+            printf("erase_pages(%u,%u) %s\n",page,rc,xa_name[r]);
+            return(1);
+        }
+        erase_bytes+=rc*FLASH_PAGE_SIZE;
+        page+=rc;
+        count-=rc;
     }
-    printf("went\n");
+    INFO("erased\n");
     return(0);
 }
 //-----------------------------------------------------------------------------
-int read_unprotect ( void )
+int erase_page ( unsigned int page )
 {
-    unsigned int ra,rb;
+    TRACE("erase_page(%u)\n",page);
+    return(erase_pages(page,1));
+}
+//-----------------------------------------------------------------------------
+//erase just the pages an image at add of len bytes touches, segments
+//not wholly in flash (sram) are never erased
+int erase_image ( unsigned int add, unsigned int len )
+{
+    unsigned int first,last;
 
-    printf("read_unprotect()\n");
-    sdata[0]=0x92;
-    sdata[1]=sdata[0]^0xFF;
-    ser_senddata(sdata,2);
-    while(1)
+    if(len==0) return(0);
+    if(!in_flash(add,len))
     {
-        rb=ser_copystring(rdata);
-        if(rb==2)
-        {
-            ser_dump(rb);
-            break;
-        }
+        INFO("0x%08X %u bytes is not in flash, no erase\n",add,len);
+        return(0);
     }
-    if((rdata[0]!=0x79)||(rdata[1]!=0x79))
+    first=(add-FLASH_BASE)/FLASH_PAGE_SIZE;
+    last=(add-FLASH_BASE+len-1)/FLASH_PAGE_SIZE;
+    return(erase_pages(first,last-first+1));
+}
+//-----------------------------------------------------------------------------
+//global erase, 0xFFFF for Extended Erase, 0xFF for Erase
+int erase_flash ( void )
+{
+    struct xphase ph[1]={ { sdata,0 } };
+    unsigned int cmd;
+    int r;
+
+    INFO("erase_flash()\n");
+    cmd=has_cmd(0x44)?0x44:0x43;
+    sdata[0]=0xFF;
+    sdata[1]=0xFF;
+    ph[0].len=(cmd==0x44)?2:1;
+    r=transact(cmd,ph,1,NULL,0);
+    if(r)
     {
-        printf("read_unprotect error\n");
-        for(ra=0;ra<rb;ra++) printf("0x%02X\n",rdata[ra]);
+        printf("erase_flash %s\n",xa_name[r]);
         return(1);
     }
+    INFO("erased\n");
     return(0);
 }
 //-----------------------------------------------------------------------------
-int do_stm_stuff ( void )
+int go ( unsigned int add )
 {
-    unsigned int ra,rb,rc;
-
-
-    if(detect_chip()) return(1);
-    //if(get()) return(1);
-    //if(getverpstat()) return(1);
-    //if(getid()) return(1);
-
-
-    if(erase_flash()) return(1);
-
-    //if(read_unprotect()) return(1);
-    //sleep(1);
-    //if(detect_chip()) return(1);
-
-
-    if(read_mem_32(0x08000000,&rc)) return(1);
-    if(read_mem_32(0x08000004,&rc)) return(1);
-    if(read_mem_32(0x08000008,&rc)) return(1);
-
+    unsigned char a[4];
+    struct xphase ph[1]={ { a,4 } };
+    int r;
 
-    for(ra=0;ra<bindatalen;ra++)
+    INFO("go(0x%08X)\n",add);
+    put_addr(a,add);
+    r=transact(0x21,ph,1,NULL,0);
+    if(r)
     {
-        if(write_mem_32(0x08000000+(ra<<2),bindata[ra])) return(1);
+        printf("go %s\n",xa_name[r]);
+        return(1);
+    }
+    INFO("went\n");
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int read_unprotect ( void )
+{
+    int r;
+
+    INFO("read_unprotect()\n");
+    r=transact(0x92,NULL,0,NULL,0);
+    if(r)
+    {
+        printf("read_unprotect %s\n",xa_name[r]);
+        return(1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//Read Memory is NACKed up front while readout protection is on
+//returns 1 protected, 0 not, -1 no sensible answer
+int read_protected ( void )
+{
+    unsigned char a[4];
+    unsigned char n[1];
+    struct xphase ph[2]={ { a,4 }, { n,1 } };
+    int r;
+
+    put_addr(a,FLASH_BASE);
+    n[0]=4-1;
+    r=transact(0x11,ph,2,rdata,4);
+    if(r==XA_NACK)
+    {
+        INFO("read protected\n");
+        return(1);
+    }
+    if(r)
+    {
+        printf("read_protected %s\n",xa_name[r]);
+        return(-1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//read back a programmed segment and compare it to the image, WB_DIRTY
+//with the block that differs in *bad and *badlen
+int verify_image ( unsigned int add, const unsigned char *data, unsigned int len, unsigned int *bad, unsigned int *badlen )
+{
+    unsigned int ra,rb;
+    unsigned char *rp;
+
+    TRACE("verify_image(0x%08X,%u)\n",add,len);
+    for(ra=0;ra<len;ra+=rb)
+    {
+        rb=len-ra;
+        if(rb>256) rb=256;
+        rp=read_mem_ptr(add+ra,(rb+3)&(~3));
+        if(rp==NULL) return(WB_FAILED);
+        if(memcmp(rp,data+ra,rb))
+        {
+            ser_dump((rb+3)&(~3));
+            printf("verify error at 0x%08X\n",add+ra);
+            *bad=add+ra;
+            *badlen=rb;
+            return(WB_DIRTY);
+        }
+        ser_dump((rb+3)&(~3));
+    }
+    INFO("verified\n");
+    return(WB_OK);
+}
+//-----------------------------------------------------------------------------
+//time count Get Version transactions at each configured rate, once
+//with a tcdrain() after every send and once without
+int latency_test ( unsigned int count )
+{
+    unsigned int ra,rb,rc;
+    unsigned long long t[2];
+    int drain;
+
+    for(ra=0;ra<nbauds;ra++)
+    {
+        if(ser_setbaud(bauds[ra])) continue;
+        if(dtr_reset) strobedtr();
+        ser_flush();
+        if(detect_chip())
+        {
+            printf("%u baud: no sync, skipped\n",bauds[ra]);
+            continue;
+        }
+        for(drain=1;drain>=0;drain--)
+        {
+            ser_set_drain(drain);
+            t[drain]=stats_now();
+            for(rb=0;rb<count;rb++)
+            {
+                sdata[0]=0x01;
+                sdata[1]=sdata[0]^0xFF;
+                ser_senddata(sdata,2);
+                rc=ser_recv(rdata,5,ACK_TIMEOUT);
+                if((rc!=5)||(rdata[0]!=0x79)||(rdata[4]!=0x79))
+                {
+                    printf("%u baud: get version failed\n",bauds[ra]);
+                    ser_set_drain(0);
+                    return(1);
+                }
+            }
+            t[drain]=(stats_now()-t[drain])/count;
+        }
+        ser_set_drain(0);
+        printf("%u baud: %llu us with tcdrain, %llu us without, %lld us saved per transaction\n",
+            bauds[ra],t[1],t[0],(long long)(t[1]-t[0]));
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned int crc32 ( unsigned int crc, const unsigned char *s, unsigned int len )
+{
+    static const unsigned int crctab[16]=
+    {
+        0x00000000,0x1DB71064,0x3B6E20C8,0x26D930AC,
+        0x76DC4190,0x6B6B51F4,0x4DB26158,0x5005713C,
+        0xEDB88320,0xF00F9344,0xD6D6A3E8,0xCB61B38C,
+        0x9B64C2B0,0x86D3D2D4,0xA00AE278,0xBDBDF21C
+    };
+
+    while(len--)
+    {
+        crc^=*s++;
+        crc=(crc>>4)^crctab[crc&0xF];
+        crc=(crc>>4)^crctab[crc&0xF];
+    }
+    return(crc);
+}
+//-----------------------------------------------------------------------------
+//put the loader and its parameters in sram and start it
+int fast_upload ( unsigned int flags )
+{
+    struct image stub;
+    unsigned int ra,rb;
+
+    if(image_load(&stub,fast_stub,FAST_BASE,0)) return(1);
+    if((stub.nsegs!=1)||(stub.seg[0].addr!=FAST_BASE)||((FAST_BASE+stub.seg[0].len)>FAST_PARM))
+    {
+        printf("%s: does not fit at 0x%08X\n",fast_stub,FAST_BASE);
+        image_free(&stub);
+        return(1);
+    }
+    for(ra=0;ra<stub.seg[0].len;ra+=rb)
+    {
+        rb=stub.seg[0].len-ra;
+        if(rb>256) rb=256;
+        if(write_retry(FAST_BASE+ra,stub.seg[0].data+ra,rb)!=WB_OK)
+        {
+            image_free(&stub);
+            return(1);
+        }
+    }
+    fast_stub_len=stub.seg[0].len;
+    image_free(&stub);
+    udata[0]=(fast_baud>> 0)&0xFF;
+    udata[1]=(fast_baud>> 8)&0xFF;
+    udata[2]=(fast_baud>>16)&0xFF;
+    udata[3]=(fast_baud>>24)&0xFF;
+    udata[4]=(flags>> 0)&0xFF;
+    udata[5]=(flags>> 8)&0xFF;
+    udata[6]=(flags>>16)&0xFF;
+    udata[7]=(flags>>24)&0xFF;
+    if(write_retry(FAST_PARM,udata,8)!=WB_OK) return(1);
+    return(go(FAST_BASE));
+}
+//-----------------------------------------------------------------------------
+//writes get padded out to a whole halfword
+void fast_frame ( struct fast_slot *f, unsigned int cmd, unsigned int seq, unsigned int add, const unsigned char *data, unsigned int len )
+{
+    unsigned char *p;
+    unsigned int crc;
+
+    p=f->frame;
+    p[0]=FAST_SOF;
+    p[1]=cmd;
+    p[2]=seq;
+    memcpy(&p[9],data,len);
+    if(len&1) p[9+(len++)]=0xFF;
+    p[3]=(len>> 0)&0xFF;
+    p[4]=(len>> 8)&0xFF;
+    p[5]=(add>> 0)&0xFF;
+    p[6]=(add>> 8)&0xFF;
+    p[7]=(add>>16)&0xFF;
+    p[8]=(add>>24)&0xFF;
+    crc=~crc32(0xFFFFFFFF,&p[1],8+len);
+    p[ 9+len]=(crc>> 0)&0xFF;
+    p[10+len]=(crc>> 8)&0xFF;
+    p[11+len]=(crc>>16)&0xFF;
+    p[12+len]=(crc>>24)&0xFF;
+    f->busy=1;
+    f->seq=seq;
+    f->addr=add;
+    f->len=len+13;
+    f->tries=0;
+}
+//-----------------------------------------------------------------------------
+//returns 0 with a well formed reply, 1 on timeout or garbage
+int fast_reply ( unsigned int *seq, unsigned int *status, unsigned int *crc, unsigned int ms )
+{
+    unsigned int ra,rb,rc;
+
+    rb=ser_recv(rdata,8,ms);
+    if(rb!=8) return(1);
+    rc=0;
+    for(ra=0;ra<8;ra++) rc^=rdata[ra];
+    if((rdata[0]!=FAST_REPLY)||rc)
+    {
+        //out of step, let the line go quiet and start over
+        usleep(10000);
+        ser_flush();
+        return(1);
+    }
+    *seq=rdata[1];
+    *status=rdata[2];
+    *crc=rdata[3]|(rdata[4]<<8)|(rdata[5]<<16)|(rdata[6]<<24);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//one frame, one reply, for crc queries
+int fast_crc ( unsigned int add, unsigned int len, unsigned int *crc )
+{
+    struct fast_slot *f;
+    unsigned int ra;
+    unsigned int seq;
+    unsigned int status;
+
+    f=&fslot[0];
+    udata[0]=(len>> 0)&0xFF;
+    udata[1]=(len>> 8)&0xFF;
+    udata[2]=(len>>16)&0xFF;
+    udata[3]=(len>>24)&0xFF;
+    fast_frame(f,FAST_CRC,0xFF,add,udata,4);
+    for(ra=0;ra<FAST_RETRIES;ra++)
+    {
+        ser_senddata(f->frame,f->len);
+        f->sent=stats_now();
+        if(fast_reply(&seq,&status,crc,FAST_TIMEOUT)) continue;
+        if((seq!=f->seq)||(status!=0)) continue;
+        stats_cmd(STAT_FAST_CRC,stats_now()-f->sent);
+        f->busy=0;
+        return(0);
+    }
+    f->busy=0;
+    printf("fast_crc(0x%08X,%u) no answer\n",add,len);
+    return(1);
+}
+//-----------------------------------------------------------------------------
+//stream the whole image with up to FAST_WINDOW frames unanswered,
+//only frames that come back bad or not at all are sent again
+int fast_write ( void )
+{
+    const struct segment *seg;
+    struct fast_slot *f;
+    unsigned int ra,rb;
+    unsigned int sn;
+    unsigned int off;
+    unsigned int seq;
+    unsigned int inflight;
+    unsigned int rs,st,rc;
+
+    sn=0;
+    off=0;
+    seq=0;
+    inflight=0;
+    for(ra=0;ra<FAST_WINDOW;ra++) fslot[ra].busy=0;
+    while(1)
+    {
+        for(ra=0;(ra<FAST_WINDOW)&&(sn<image.nsegs);ra++)
+        {
+            f=&fslot[ra];
+            if(f->busy) continue;
+            seg=&image.seg[sn];
+            rb=seg->len-off;
+            if(rb>FAST_BLOCK) rb=FAST_BLOCK;
+            fast_frame(f,FAST_WRITE,seq,seg->addr+off,seg->data+off,rb);
+            seq=(seq+1)&0x7F;
+            ser_senddata(f->frame,f->len);
+            f->sent=stats_now();
+            inflight++;
+            off+=rb;
+            if(off>=seg->len)
+            {
+                sn++;
+                off=0;
+            }
+        }
+        if(inflight==0) break;
+        if(fast_reply(&rs,&st,&rc,FAST_TIMEOUT))
+        {
+            //nothing sensible came back, everything outstanding goes again
+            for(ra=0;ra<FAST_WINDOW;ra++)
+            {
+                f=&fslot[ra];
+                if(!f->busy) continue;
+                if(++f->tries>FAST_RETRIES)
+                {
+                    printf("fast_write no answer for 0x%08X\n",f->addr);
+                    return(1);
+                }
+                ser_senddata(f->frame,f->len);
+                f->sent=stats_now();
+                fast_resent++;
+            }
+            continue;
+        }
+        for(ra=0;ra<FAST_WINDOW;ra++) if(fslot[ra].busy&&(fslot[ra].seq==rs)) break;
+        //late answer to a frame that was sent twice
+        if(ra==FAST_WINDOW) continue;
+        f=&fslot[ra];
+        if(st==1)
+        {
+            if(++f->tries>FAST_RETRIES)
+            {
+                printf("fast_write too many crc errors at 0x%08X\n",f->addr);
+                return(1);
+            }
+            ser_senddata(f->frame,f->len);
+            f->sent=stats_now();
+            fast_resent++;
+            continue;
+        }
+        if(st)
+        {
+            printf("fast_write error %u at 0x%08X\n",st,f->addr);
+            return(1);
+        }
+        stats_cmd(STAT_FAST_WRITE,stats_now()-f->sent);
+        f->busy=0;
+        inflight--;
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//hand the flash work over to the sram loader at fast_baud, the pages
+//are erased by the loader as they are first written unless the whole
+//part was erased already
+int fast_program ( void )
+{
+    unsigned int ra,rb,rc;
+    const struct segment *seg;
+
+    stats_begin(PH_UPLOAD);
+    if(fast_upload(mass_erase?FAST_ERASED:0)) return(1);
+    if(ser_setbaud(fast_baud)) return(1);
+    usleep(10000);
+    ser_flush();
+    //an empty crc query answers once the loader is listening
+    for(ra=0;ra<20;ra++)
+    {
+        fslot[0].busy=0;
+        fast_frame(&fslot[0],FAST_CRC,0xFF,FLASH_BASE,(const unsigned char *)"\0\0\0\0",4);
+        ser_senddata(fslot[0].frame,fslot[0].len);
+        if(fast_reply(&rb,&rc,&rc,100)==0) break;
+    }
+    if(ra==20)
+    {
+        printf("no answer from the loader at %u baud\n",fast_baud);
+        return(1);
+    }
+    stats_end(PH_UPLOAD,fast_stub_len);
+    INFO("loader running at %u baud\n",fast_baud);
+    fast_resent=0;
+    stats_begin(PH_WRITE);
+    if(fast_write()) return(1);
+    stats_end(PH_WRITE,image_size(&image));
+    INFO("fast_write %u frames resent\n",fast_resent);
+    stats_begin(PH_VERIFY);
+    for(ra=0;ra<image.nsegs;ra++)
+    {
+        seg=&image.seg[ra];
+        if(fast_crc(seg->addr,seg->len,&rc)) return(1);
+        if(rc!=~crc32(0xFFFFFFFF,seg->data,seg->len))
+        {
+            printf("verify error in 0x%08X %u bytes\n",seg->addr,seg->len);
+            return(1);
+        }
+    }
+    stats_end(PH_VERIFY,image_size(&image));
+    INFO("verified\n");
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//start the new image through its vector table, the rom bootloader is
+//gone after this
+int go_image ( void )
+{
+    if(!go_after) return(0);
+    stats_begin(PH_GO);
+    if(go(image.seg[0].addr)) return(1);
+    stats_end(PH_GO,0);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+void console_sig ( int sig )
+{
+    (void)sig;
+    console_stop=1;
+}
+//-----------------------------------------------------------------------------
+int con_flush ( void )
+{
+    if(con_used==0) return(0);
+    if(ser_write_fd(1,con_buf,con_used)) return(1);
+    if(con_fd>=0)
+    {
+        if(ser_write_fd(con_fd,con_buf,con_used)) return(1);
+    }
+    con_used=0;
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//stay on the line after Go and pass on what the application prints,
+//8N1 at its rate, each line stamped with the time since Go.  the reader
+//thread keeps taking bytes into the ring while this writes, until ^C.
+int console ( void )
+{
+    unsigned int ra,rb;
+    unsigned int bol;
+    unsigned long long t0,t,last;
+    unsigned long long total;
+    unsigned char *rp;
+
+    t0=stats_now();
+    con_fd=-1;
+    if(capture_name)
+    {
+        con_fd=open(capture_name,O_WRONLY|O_CREAT|O_TRUNC,0644);
+        if(con_fd<0)
+        {
+            printf("open %s failed\n",capture_name);
+            return(1);
+        }
+    }
+    if(ser_setparity(0)||ser_setbaud(console_baud))
+    {
+        printf("console at %u baud failed\n",console_baud);
+        if(con_fd>=0) close(con_fd);
+        return(1);
     }
-    for(ra=0;ra<10;ra++)
+    INFO("console at %u baud, ^C to stop\n",console_baud);
+    fflush(stdout);
+    signal(SIGINT,console_sig);
+    con_used=0;
+    bol=1;
+    total=0;
+    last=t0;
+    while(!console_stop)
     {
-        if(read_mem_32(0x08000000+(ra<<2),&rc)) return(1);
+        rb=ser_wait(1,CON_FLUSH);
+        t=stats_now();
+        if((rb==0)||((t-last)>=(CON_FLUSH*1000ULL)))
+        {
+            if(con_flush()) break;
+            last=t;
+        }
+        if(rb==0) continue;
+        rp=ser_peek(rb,0);
+        t-=t0;
+        for(ra=0;ra<rb;ra++)
+        {
+            //room for a stamp and the byte
+            if(con_used>(CON_BUF-32))
+            {
+                if(con_flush()) break;
+                last=t0+t;
+            }
+            if(bol)
+            {
+                con_used+=sprintf((char *)&con_buf[con_used],"[%5llu.%06llu] ",t/1000000,t%1000000);
+                bol=0;
+            }
+            con_buf[con_used++]=rp[ra];
+            if(rp[ra]=='\n') bol=1;
+        }
+        ser_dump(rb);
+        total+=rb;
+        if(ra<rb) break;
     }
+    ra=con_flush();
+    signal(SIGINT,SIG_DFL);
+    if(con_fd>=0) close(con_fd);
+    INFO("\nconsole: %llu bytes in %.3f s\n",total,(stats_now()-t0)/1000000.0);
+    return(ra);
+}
+//-----------------------------------------------------------------------------
+int discover ( void )
+{
+    if(get()) return(1);
+    if(getverpstat()) return(1);
+    caps_save(chip_id);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int erase_all ( void )
+{
+    unsigned int ra;
+
+    if(mass_erase) return(erase_flash());
+    for(ra=0;ra<image.nsegs;ra++)
+    {
+        if(erase_image(image.seg[ra].addr,image.seg[ra].len)) return(1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned int page_of ( unsigned int add )
+{
+    if(add<FLASH_BASE) return(NO_PAGE);
+    add=(add-FLASH_BASE)/FLASH_PAGE_SIZE;
+    if(add>=MAX_PAGES) return(NO_PAGE);
+    return(add);
+}
+//-----------------------------------------------------------------------------
+//what the journal is keyed by besides the unique id, where every segment
+//goes and what is in it
+unsigned int hash_image ( void )
+{
+    unsigned int ra;
+    unsigned int crc;
+    unsigned char b[8];
+
+    crc=0xFFFFFFFF;
+    for(ra=0;ra<image.nsegs;ra++)
+    {
+        put_addr(b,image.seg[ra].addr);
+        put_addr(b+4,image.seg[ra].len);
+        crc=crc32(crc,b,8);
+        crc=crc32(crc,image.seg[ra].data,image.seg[ra].len);
+    }
+    return(~crc);
+}
+//-----------------------------------------------------------------------------
+//line format: uid hash pages, a journal for another image is no use
+int journal_load ( const char *uid, unsigned int hash )
+{
+    FILE *fp;
+    char line[MAX_PAGES+64];
+    char *s;
+    unsigned int ra;
+
+    if(journal_path[0]==0) return(1);
+    fp=fopen(journal_path,"rt");
+    if(fp==NULL) return(1);
+    while(fgets(line,sizeof(line),fp))
+    {
+        if(strncmp(line,uid,UID_LEN<<1)||(line[UID_LEN<<1]!=' ')) continue;
+        s=&line[UID_LEN<<1];
+        if(strtoul(s,&s,16)!=hash) break;
+        while(*s==' ') s++;
+        for(ra=0;ra<MAX_PAGES;ra++)
+        {
+            if((s[ra]!='e')&&(s[ra]!='w')&&(s[ra]!='.')) break;
+            page_state[ra]=s[ra];
+        }
+        fclose(fp);
+        return(0);
+    }
+    fclose(fp);
+    return(1);
+}
+//-----------------------------------------------------------------------------
+//rewrite the journal with this chip's line updated, or dropped once
+//the session is done
+int journal_save ( const char *uid, unsigned int hash, unsigned int keep )
+{
+    FILE *fp;
+    FILE *fpo;
+    char line[MAX_PAGES+64];
+    char tmp[520];
+    unsigned int ra;
+
+    if(journal_path[0]==0) return(1);
+    snprintf(tmp,sizeof(tmp),"%s.%u",journal_path,(unsigned int)getpid());
+    fpo=fopen(tmp,"wt");
+    if(fpo==NULL) return(1);
+    fp=fopen(journal_path,"rt");
+    if(fp)
+    {
+        while(fgets(line,sizeof(line),fp))
+        {
+            if(strncmp(line,uid,UID_LEN<<1)) fputs(line,fpo);
+        }
+        fclose(fp);
+    }
+    if(keep)
+    {
+        for(ra=MAX_PAGES;ra;ra--) if(page_state[ra-1]!='.') break;
+        fprintf(fpo,"%s %08X %.*s\n",uid,hash,(int)ra,page_state);
+    }
+    fclose(fpo);
+    return(rename(tmp,journal_path));
+}
+//-----------------------------------------------------------------------------
+//every flash page the image touches has been erased
+void journal_erased ( void )
+{
+    unsigned int ra,rb,rc;
+    const struct segment *seg;
+
+    for(ra=0;ra<image.nsegs;ra++)
+    {
+        seg=&image.seg[ra];
+        if(seg->len==0) continue;
+        rb=page_of(seg->addr);
+        rc=page_of(seg->addr+seg->len-1);
+        if((rb==NO_PAGE)||(rc==NO_PAGE)) continue;
+        for(;rb<=rc;rb++) page_state[rb]='e';
+    }
+    journal_save(chip_uid,image_hash,1);
+}
+//-----------------------------------------------------------------------------
+//a block ending at end of segment sg was just written, nothing more of
+//the image goes in page pg unless the rest of sg or a later segment does
+int page_finished ( unsigned int sg, unsigned int end, unsigned int pg )
+{
+    unsigned int ra;
+    const struct segment *seg;
+
+    seg=&image.seg[sg];
+    if((end<seg->len)&&(page_of(seg->addr+end)==pg)) return(0);
+    for(ra=sg+1;ra<image.nsegs;ra++)
+    {
+        seg=&image.seg[ra];
+        if(seg->len==0) continue;
+        if((page_of(seg->addr)<=pg)&&(page_of(seg->addr+seg->len-1)>=pg)) return(0);
+    }
+    return(1);
+}
+//-----------------------------------------------------------------------------
+//mark the pages the block at offset rc of segment sg finished, returns
+//how many
+unsigned int page_mark ( unsigned int sg, unsigned int rc, unsigned int len )
+{
+    unsigned int pg,last;
+    unsigned int n;
+    const struct segment *seg;
+
+    seg=&image.seg[sg];
+    pg=page_of(seg->addr+rc);
+    last=page_of(seg->addr+rc+len-1);
+    if((pg==NO_PAGE)||(last==NO_PAGE)) return(0);
+    for(n=0;pg<=last;pg++)
+    {
+        if(page_state[pg]=='w') continue;
+        if(!page_finished(sg,rc+len,pg)) continue;
+        page_state[pg]='w';
+        n++;
+    }
+    return(n);
+}
+//-----------------------------------------------------------------------------
+//the pages add to add+len touches are to be written again
+void page_reset ( unsigned int add, unsigned int len )
+{
+    unsigned int pg,last;
+
+    pg=page_of(add);
+    last=page_of(add+len-1);
+    if((pg==NO_PAGE)||(last==NO_PAGE)) return;
+    for(;pg<=last;pg++) page_state[pg]='.';
+}
+//-----------------------------------------------------------------------------
+//the offset in seg from rc on that is not in a page marked written
+unsigned int skip_written ( const struct segment *seg, unsigned int rc )
+{
+    unsigned int pg;
+
+    while(rc<seg->len)
+    {
+        pg=page_of(seg->addr+rc);
+        if((pg==NO_PAGE)||(page_state[pg]!='w')) break;
+        rc=FLASH_BASE+((pg+1)*FLASH_PAGE_SIZE)-seg->addr;
+    }
+    return(rc);
+}
+//-----------------------------------------------------------------------------
+//first and last byte of the pages add to add+len touches
+void page_span ( unsigned int add, unsigned int len, unsigned int *start, unsigned int *end )
+{
+    *start=add&(~(FLASH_PAGE_SIZE-1));
+    *end=((add+len-1)|(FLASH_PAGE_SIZE-1));
+}
+//-----------------------------------------------------------------------------
+//the first segment with anything in the pages add to add+len touches
+unsigned int first_seg_in ( unsigned int add, unsigned int len )
+{
+    unsigned int ra;
+    unsigned int start,end;
+    const struct segment *seg;
+
+    page_span(add,len,&start,&end);
+    for(ra=0;ra<image.nsegs;ra++)
+    {
+        seg=&image.seg[ra];
+        if(seg->len==0) continue;
+        if((seg->addr<=end)&&((seg->addr+seg->len-1)>=start)) break;
+    }
+    return(ra);
+}
+//-----------------------------------------------------------------------------
+//erase every page add to add+len touches and write back all any segment
+//has in them, after that they hold all they ever will
+int rewrite_pages ( unsigned int add, unsigned int len )
+{
+    unsigned int ra,rb,rc,rd;
+    unsigned int start,end;
+    const struct segment *seg;
+
+    page_span(add,len,&start,&end);
+    INFO("rewriting 0x%08X to 0x%08X\n",start,end);
+    if(erase_pages(page_of(start),((end-start)/FLASH_PAGE_SIZE)+1)) return(1);
+    for(ra=first_seg_in(add,len);ra<image.nsegs;ra++)
+    {
+        seg=&image.seg[ra];
+        if(seg->len==0) continue;
+        if((seg->addr>end)||((seg->addr+seg->len-1)<start)) continue;
+        rc=(start>seg->addr)?(start-seg->addr):0;
+        rd=((seg->addr+seg->len-1)>end)?(end+1-seg->addr):seg->len;
+        for(;rc<rd;rc+=rb)
+        {
+            rb=rd-rc;
+            if(rb>write_block) rb=write_block;
+            if(write_retry(seg->addr+rc,seg->data+rc,rb)!=WB_OK) return(1);
+        }
+    }
+    for(ra=page_of(start);ra<=page_of(end);ra++) page_state[ra]='w';
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//find the bootloader and learn what it can do, from the cache if it
+//has this chip id
+int attach ( unsigned int *cached )
+{
+    if(negotiate()) return(1);
+    //the chip id is the cache key so it is always asked for
+    if(getid()) return(1);
+    *cached=0;
+    if(no_cache||caps_load(chip_id))
+    {
+        if(discover()) return(1);
+    }
+    else *cached=1;
+    if(check_caps()) return(1);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int readout_ff ( int fd, unsigned int len )
+{
+    unsigned int ra;
+
+    memset(ff_buf,0xFF,sizeof(ff_buf));
+    for(;len;len-=ra)
+    {
+        ra=(len>sizeof(ff_buf))?sizeof(ff_buf):len;
+        if(ser_write_fd(fd,ff_buf,ra)) return(1);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//with -H erased flash in a regular file is left as holes.  they read as
+//zeros, and image_load() skips them when progstm -H asks it to.  only
+//whole file system blocks can be holes, so the edges, and all of it for
+//a pipe, are written out as 0xFF.
+int readout_hole ( int fd, unsigned int len )
+{
+    struct stat st;
+    unsigned int head,skip;
+    off_t off;
+
+    if(len==0) return(0);
+    head=len;
+    skip=0;
+    off=lseek(fd,0,SEEK_CUR);
+    if((off!=(off_t)-1)&&(fstat(fd,&st)==0)&&S_ISREG(st.st_mode)&&(st.st_blksize>0))
+    {
+        head=(st.st_blksize-(off%st.st_blksize))%st.st_blksize;
+        if(head>len) head=len;
+        skip=((len-head)/st.st_blksize)*st.st_blksize;
+    }
+    if(readout_ff(fd,head)) return(1);
+    if(skip)
+    {
+        if(lseek(fd,skip,SEEK_CUR)==(off_t)-1) return(1);
+    }
+    return(readout_ff(fd,len-head-skip));
+}
+//-----------------------------------------------------------------------------
+//save all of flash a page at a time, 256 byte Read Memory blocks.  the
+//rom has no checksum command so every byte crosses the line, with -H an
+//erased page only saves the write and the disk space.
+int do_readout ( void )
+{
+    unsigned int ra,rb;
+    unsigned int size;
+    unsigned int hole;
+    unsigned int erased;
+    unsigned long long *lp;
+    off_t off;
+    int fd;
+
+    stats_begin(PH_DETECT);
+    if(attach(&ra)) return(1);
+    //unprotecting would mass erase the very thing wanted
+    rb=read_protected();
+    if(rb)
+    {
+        if(rb==1) printf("read protected, nothing to read out\n");
+        return(1);
+    }
+    size=FLASH_SIZE_DEF;
+    if(read_mem_32(FLASH_SIZE_REG,&rb)==0)
+    {
+        rb=(rb&0xFFFF)<<10;
+        if((rb!=0)&&(rb<=(MAX_PAGES*FLASH_PAGE_SIZE))) size=rb;
+    }
+    stats_end(PH_DETECT,0);
+    INFO("reading %u bytes of flash\n",size);
+
+    readout_bytes=size;
+    if(readout_fd>=0) fd=readout_fd;
+    else fd=open(readout_name,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fd<0)
+    {
+        printf("open %s failed\n",readout_name);
+        return(1);
+    }
+    stats_begin(PH_READOUT);
+    hole=0;
+    erased=0;
+    for(ra=0;ra<size;ra+=FLASH_PAGE_SIZE)
+    {
+        for(rb=0;rb<FLASH_PAGE_SIZE;rb+=256)
+        {
+            if(read_mem(FLASH_BASE+ra+rb,page_buf+rb,256)) break;
+        }
+        if(rb<FLASH_PAGE_SIZE) break;
+        lp=(unsigned long long *)page_buf;
+        for(rb=0;rb<(FLASH_PAGE_SIZE/8);rb++) if(lp[rb]!=0xFFFFFFFFFFFFFFFFULL) break;
+        if(rb==(FLASH_PAGE_SIZE/8))
+        {
+            erased++;
+            if(image_flags&IMAGE_HOLES)
+            {
+                hole+=FLASH_PAGE_SIZE;
+                continue;
+            }
+        }
+        if(readout_hole(fd,hole)) break;
+        hole=0;
+        if(ser_write_fd(fd,page_buf,FLASH_PAGE_SIZE)) break;
+    }
+    if((ra>=size)&&hole)
+    {
+        if(readout_hole(fd,hole)) ra=0;
+        else
+        {
+            //seeking past the end makes no file bigger
+            off=lseek(fd,0,SEEK_CUR);
+            if((off!=(off_t)-1)&&ftruncate(fd,off)) ra=0;
+        }
+    }
+    close(fd);
+    if(ra<size)
+    {
+        printf("readout stopped at 0x%08X\n",FLASH_BASE+ra);
+        return(1);
+    }
+    stats_end(PH_READOUT,size);
+    INFO("%u of %u pages erased\n",erased,size/FLASH_PAGE_SIZE);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+int do_stm_stuff ( void )
+{
+    unsigned int ra,rb,rc,rd;
+    unsigned int rewrites;
+    unsigned int cached;
+    unsigned int resume;
+    int prot;
+    const struct segment *seg;
+
+
+    stats_begin(PH_DETECT);
+    if(attach(&cached)) return(1);
+
+    //only unprotect when reads are refused, the chip mass erases and
+    //resets so it has to be found again
+    prot=read_protected();
+    if(prot==-1) return(1);
+    if(prot)
+    {
+        if(!has_cmd(0x92))
+        {
+            printf("read protected and no Readout Unprotect\n");
+            return(1);
+        }
+        if(read_unprotect()) return(1);
+        usleep(100000);
+        if(negotiate()) return(1);
+    }
+
+    //the sram loader is quick enough to always start over.  a chip that
+    //was just unprotected is blank, whatever the journal says.  the
+    //unique id can only be read once it is unprotected.
+    resume=0;
+    memset(page_state,'.',MAX_PAGES);
+    page_state[MAX_PAGES]=0;
+    if(!fast_baud)
+    {
+        if(read_uid()) return(1);
+        image_hash=hash_image();
+        if(!fresh&&!prot&&(journal_load(chip_uid,image_hash)==0))
+        {
+            INFO("resuming an unfinished session\n");
+            resume=1;
+        }
+    }
+
+    stats_end(PH_DETECT,0);
+
+    //a NACKed erase with cached capabilities means another bootloader
+    //answers to the same chip id, ask it and try once more.  the sram
+    //loader erases pages itself as it goes, unless asked for a global
+    //erase.  a resumed session did its erase the first time around.
+    if(!resume&&(mass_erase||!fast_baud))
+    {
+        stats_begin(PH_ERASE);
+        erase_bytes=0;
+        while(erase_all())
+        {
+            if(!cached) return(1);
+            INFO("stale capability cache\n");
+            cached=0;
+            if(discover()) return(1);
+            if(check_caps()) return(1);
+        }
+        stats_end(PH_ERASE,erase_bytes);
+    }
+
+    if(fast_baud) return(fast_program());
+    if(!resume) journal_erased();
+
+    //write blocks straight out of the mapped image, pages the journal
+    //has as written are skipped.  resuming, the blocks after them are
+    //read back until the first that still needs writing, from there on
+    //it is a normal session.  a block that will not take has its pages
+    //erased and all the image has in them written again.
+    stats_begin(PH_WRITE);
+    rewrites=0;
+    for(ra=0;ra<image.nsegs;ra++)
+    {
+        seg=&image.seg[ra];
+        for(rc=skip_written(seg,0);rc<seg->len;rc=skip_written(seg,rc+rb))
+        {
+            rb=seg->len-rc;
+            if(rb>write_block) rb=write_block;
+            rd=WB_ERASED;
+            if(resume)
+            {
+                rd=block_state(seg->addr+rc,seg->data+rc,rb);
+                if(rd==WB_OK) continue;
+                INFO("resuming at 0x%08X\n",seg->addr+rc);
+                resume=0;
+            }
+            //sram takes a plain overwrite
+            if((rd==WB_ERASED)||((rd==WB_DIRTY)&&!in_flash(seg->addr+rc,rb)))
+            {
+                rd=write_retry(seg->addr+rc,seg->data+rc,rb);
+            }
+            if(rd==WB_OK)
+            {
+                if(page_mark(ra,rc,rb)) journal_save(chip_uid,image_hash,1);
+                continue;
+            }
+            //write_retry() only says dirty for flash
+            if((rd!=WB_DIRTY)||(rewrites>=MAX_REWRITES)) return(1);
+            rewrites++;
+            if(rewrite_pages(seg->addr+rc,rb)) return(1);
+            journal_save(chip_uid,image_hash,1);
+        }
+    }
+    stats_end(PH_WRITE,image_size(&image));
+
+    //a block that reads back wrong gets its pages rewritten like a
+    //dirty one above, then everything in them is read back again
+    stats_begin(PH_VERIFY);
+    ra=0;
+    while(ra<image.nsegs)
+    {
+        seg=&image.seg[ra];
+        rd=verify_image(seg->addr,seg->data,seg->len,&rc,&rb);
+        if(rd==WB_OK)
+        {
+            ra++;
+            continue;
+        }
+        //the journal must not send a later session past these pages
+        page_reset(rc,rb);
+        journal_save(chip_uid,image_hash,1);
+        if((rd!=WB_DIRTY)||(rewrites>=MAX_REWRITES)) return(1);
+        rewrites++;
+        if(in_flash(rc,rb))
+        {
+            if(rewrite_pages(rc,rb)) return(1);
+            journal_save(chip_uid,image_hash,1);
+            ra=first_seg_in(rc,rb);
+        }
+        else
+        {
+            if(write_retry(rc,seg->data+(rc-seg->addr),rb)!=WB_OK) return(1);
+        }
+    }
+    stats_end(PH_VERIFY,image_size(&image));
+    journal_save(chip_uid,image_hash,0);
+    if(go_image()) return(1);
 
     //sdata[0]=0x92;
     //sdata[1]=sdata[0]^0xFF;
@@ -557,19 +1865,218 @@ int do_stm_stuff ( void )
     return(0);
 }
 //-----------------------------------------------------------------------------
-int main ( void )
+int cmp_baud ( const void *a, const void *b )
 {
-    unsigned int ra,rb,rc,rd;
+    unsigned int x,y;
+
+    x=*(const unsigned int *)a;
+    y=*(const unsigned int *)b;
+    if(x>y) return(-1);
+    if(x<y) return(1);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+void usage ( void )
+{
+    printf("usage: progstm [-d device] [-b baud[,baud...]] [-r] [-L n] [-w bytes] [-m] [-n] [-f] [-a addr] [-H] [-F baud [-S stub]] [-g] [-C baud [-o file]] [-q|-v] [-j] image\n");
+    printf("       progstm [-d device] [-b baud[,baud...]] [-r] [-n] [-q|-v] [-j] [-H] -O file\n");
+    printf("  image is a raw .bin, an elf or an intel .hex file\n");
+    printf("  -d  serial device, or tcp:host:port of a raw tcp serial server (default /dev/ttyUSB2)\n");
+    printf("  -b  baud rates to try, fastest first (default 57600)\n");
+    printf("  -r  pulse DTR to reset the board before each attempt\n");
+    printf("  -L  time n transactions at each rate with and without tcdrain\n");
+    printf("  -w  bytes per Write Memory, 4 to 256 (default 256)\n");
+    printf("  -m  global erase instead of erasing only the image's pages\n");
+    printf("  -n  ignore the capability cache (~/.progstm_caps) and ask again\n");
+    printf("  -f  start afresh instead of resuming from ~/.progstm_journal\n");
+    printf("  -a  load address of a raw binary (default 0x%08X)\n",FLASH_BASE);
+    printf("  -H  holes are erased flash: a raw binary's are left alone, -O makes erased\n");
+    printf("      pages holes that read as zeros instead of writing 0xFF\n");
+    printf("  -F  program through the sram loader stub running at this baud\n");
+    printf("  -S  loader stub image (default ../fastload.bin)\n");
+    printf("  -g  Go to the image's vector table once it is verified\n");
+    printf("  -C  then stay on as a console at this baud, 8N1, until ^C\n");
+    printf("  -o  also capture the console to this file\n");
+    printf("  -q  quiet, errors and the final summary only\n");
+    printf("  -v  verbose, a line for every bootloader command\n");
+    printf("  -j  print the final summary as json\n");
+    printf("  -O  read all of flash out to file (- for stdout) instead\n");
+}
+//-----------------------------------------------------------------------------
+int main ( int argc, char *argv[] )
+{
+    unsigned int ra;
+    char *s;
+    int opt;
 
-    if(ser_open())
+    ser_dev="/dev/ttyUSB2";
+    nbauds=0;
+    dtr_reset=0;
+    latency_count=0;
+    write_block=256;
+    mass_erase=0;
+    image_base=FLASH_BASE;
+    image_flags=0;
+    no_cache=0;
+    fresh=0;
+    fast_baud=0;
+    fast_stub="../fastload.bin";
+    go_after=0;
+    console_baud=0;
+    capture_name=NULL;
+    readout_name=NULL;
+    readout_fd=-1;
+    verbose=1;
+    json=0;
+    s=getenv("HOME");
+    if(s)
+    {
+        snprintf(caps_path,sizeof(caps_path),"%s/%s",s,CAPS_FILE);
+        snprintf(journal_path,sizeof(journal_path),"%s/%s",s,JOURNAL_FILE);
+    }
+    while((opt=getopt(argc,argv,"d:b:rL:w:mnfa:HF:S:gC:o:O:qvjh"))!=-1)
+    {
+        switch(opt)
+        {
+            case 'd':
+                ser_dev=optarg;
+                break;
+            case 'b':
+                for(s=optarg;*s;)
+                {
+                    if(nbauds>=MAX_BAUDS) break;
+                    bauds[nbauds]=strtoul(s,&s,10);
+                    if(bauds[nbauds]) nbauds++;
+                    if(*s) s++;
+                }
+                break;
+            case 'r':
+                dtr_reset=1;
+                break;
+            case 'L':
+                latency_count=strtoul(optarg,NULL,0);
+                break;
+            case 'w':
+                write_block=strtoul(optarg,NULL,0)&(~3);
+                if((write_block<4)||(write_block>256))
+                {
+                    usage();
+                    return(1);
+                }
+                break;
+            case 'm':
+                mass_erase=1;
+                break;
+            case 'n':
+                no_cache=1;
+                break;
+            case 'f':
+                fresh=1;
+                break;
+            case 'a':
+                image_base=strtoul(optarg,NULL,0);
+                break;
+            case 'H':
+                image_flags|=IMAGE_HOLES;
+                break;
+            case 'F':
+                fast_baud=strtoul(optarg,NULL,0);
+                break;
+            case 'S':
+                fast_stub=optarg;
+                break;
+            case 'g':
+                go_after=1;
+                break;
+            case 'C':
+                console_baud=strtoul(optarg,NULL,0);
+                if(console_baud==0)
+                {
+                    usage();
+                    return(1);
+                }
+                go_after=1;
+                break;
+            case 'o':
+                capture_name=optarg;
+                break;
+            case 'O':
+                readout_name=optarg;
+                break;
+            case 'q':
+                verbose=0;
+                break;
+            case 'v':
+                verbose=2;
+                break;
+            case 'j':
+                json=1;
+                break;
+            default:
+                usage();
+                return(1);
+        }
+    }
+    //the sram loader has replaced the rom bootloader by the end
+    if(go_after&&fast_baud)
+    {
+        usage();
+        return(1);
+    }
+    //a raw tcp serial server's rate is set on the server
+    if(fast_baud&&(strncmp(ser_dev,"tcp:",4)==0))
+    {
+        printf("-F needs a local port, the loader's rate cannot be set over tcp\n");
+        return(1);
+    }
+    if(nbauds==0) bauds[nbauds++]=57600;
+    qsort(bauds,nbauds,sizeof(bauds[0]),cmp_baud);
+    //the flash goes to stdout, everything that would have gone there
+    //goes to stderr
+    if(readout_name&&(strcmp(readout_name,"-")==0))
+    {
+        readout_fd=dup(1);
+        dup2(2,1);
+    }
+    if((latency_count==0)&&(readout_name==NULL))
+    {
+        if(optind>=argc)
+        {
+            usage();
+            return(1);
+        }
+        image_name=argv[optind];
+        if(image_load(&image,image_name,image_base,image_flags)) return(1);
+        for(ra=0;ra<image.nsegs;ra++)
+        {
+            INFO("%s: 0x%08X %u bytes\n",image_name,image.seg[ra].addr,image.seg[ra].len);
+        }
+    }
+
+    if(ser_open(ser_dev,bauds[0]))
     {
         printf("ser_open() failed\n");
         return(1);
     }
-    printf("port opened\n");
-    do_stm_stuff();
+    INFO("port opened\n");
+    link_ms=(2*ser_rtt()+999)/1000;
+    if(latency_count) ra=latency_test(latency_count);
+    else if(readout_name)
+    {
+        ra=do_readout();
+        stats_link(ser_rtt());
+        stats_summary(json,ser_dev,baud,chip_id,readout_bytes,ra);
+    }
+    else
+    {
+        ra=do_stm_stuff();
+        stats_link(ser_rtt());
+        stats_summary(json,ser_dev,fast_baud?fast_baud:baud,chip_id,image_size(&image),ra);
+        if((ra==0)&&console_baud) ra=console();
+    }
     ser_close();
-    return(0);
+    image_free(&image);
+    return(ra);
 }
 //-----------------------------------------------------------------------------
 // Copyright (C) David Welch, 2000, 2003, 2008, 2009
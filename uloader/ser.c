@@ -3,7 +3,10 @@
 // Copyright (C) David Welch, 2000
 //-----------------------------------------------------------------------------
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -12,97 +15,612 @@
 
 #include <sys/ioctl.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/serial.h>
+
+#include "ser.h"
+
+//receive ring, filled by ser_reader() and drained by the protocol code.
+//single producer single consumer: ser_head is only written by the
+//reader thread, ser_tail only by the caller, both free running.  the
+//ring is mapped twice back to back so any ser_peek() span is
+//contiguous in memory no matter where it wraps.
+#define SER_RING_SIZE (1<<16)
+#define SER_RING_MASK (SER_RING_SIZE-1)
 
 int ser_hand;
-unsigned short ser_buffcnt;
-unsigned short ser_maincnt;
-unsigned char ser_buffer[(0xFFF+1)<<1];
+unsigned char *ser_ring;
+unsigned int ser_head;
+unsigned int ser_tail;
+int ser_event;
+int ser_stop;
+int ser_drain;
+pthread_t ser_thread;
+
+int ser_custombaud ( int fd, unsigned int baud );
+
+//where a port lives: a local tty, or a raw tcp serial server named
+//tcp:host:port, whose line settings are made on the server.  which one
+//an fd is comes from the table filled in at open.
+struct ser_transport
+{
+  const char *prefix;
+  int (*open)( char *dev, unsigned int baud );
+  unsigned char (*setbaud)( int fd, unsigned int baud );
+  unsigned char (*setparity)( int fd, int even );
+  void (*flush)( int fd );
+  void (*dtr)( int fd );
+  unsigned int (*rtt)( int fd );
+};
+
+#define SER_MAX_FD 1024
+
+static const struct ser_transport *ser_fdt[SER_MAX_FD];
+
+static const struct
+{
+  unsigned int baud;
+  speed_t code;
+} ser_bauds[]=
+{
+  {   1200,   B1200 },
+  {   2400,   B2400 },
+  {   4800,   B4800 },
+  {   9600,   B9600 },
+  {  19200,  B19200 },
+  {  38400,  B38400 },
+  {  57600,  B57600 },
+  { 115200, B115200 },
+  { 230400, B230400 },
+  { 460800, B460800 },
+  { 500000, B500000 },
+  { 921600, B921600 },
+  {1000000,B1000000 },
+  {1500000,B1500000 },
+  {2000000,B2000000 },
+  {3000000,B3000000 },
+};
 
 //-----------------------------------------------------------------------------
-unsigned char ser_open ( void )
+//standard rates go through termios, anything else through termios2
+static unsigned char tty_setbaud ( int fd, unsigned int baud )
 {
   struct termios options;
+  unsigned int ra;
 
-  ser_hand=open("/dev/ttyUSB2",O_RDWR|O_NOCTTY|O_NDELAY);
-  if(ser_hand==-1)
+  if(tcgetattr(fd,&options)) return(1);
+  for(ra=0;ra<sizeof(ser_bauds)/sizeof(ser_bauds[0]);ra++)
   {
-    fprintf(stderr,"open: error - %s\n",strerror(errno));
+    if(ser_bauds[ra].baud==baud)
+    {
+      cfsetispeed(&options,ser_bauds[ra].code);
+      cfsetospeed(&options,ser_bauds[ra].code);
+      if(tcsetattr(fd,TCSANOW,&options)) return(1);
+      return(0);
+    }
+  }
+  if(ser_custombaud(fd,baud))
+  {
+    fprintf(stderr,"baud %u: error - %s\n",baud,strerror(errno));
     return(1);
   }
-  fcntl(ser_hand,F_SETFL,FNDELAY);
+  return(0);
+}
+//-----------------------------------------------------------------------------
+//the rom bootloader wants 8E1, applications mostly 8N1
+static unsigned char tty_setparity ( int fd, int even )
+{
+  struct termios options;
+
+  if(tcgetattr(fd,&options)) return(1);
+  options.c_cflag&=~(PARENB|PARODD);
+  options.c_iflag&=~(INPCK|IGNPAR);
+  if(even)
+  {
+    options.c_cflag|=PARENB;
+    options.c_iflag|=INPCK;
+  }
+  else
+  {
+    options.c_iflag|=IGNPAR;
+  }
+  if(tcsetattr(fd,TCSANOW,&options)) return(1);
+  return(0);
+}
+//-----------------------------------------------------------------------------
+static void *ser_reader ( void *arg )
+{
+  struct pollfd pfd[2];
+  unsigned int head;
+  unsigned int space;
+  uint64_t one;
+  int r;
+
+  (void)arg;
+  one=1;
+  pfd[0].fd=ser_hand;
+  pfd[0].events=POLLIN;
+  pfd[1].fd=ser_stop;
+  pfd[1].events=POLLIN;
+  while(1)
+  {
+    head=__atomic_load_n(&ser_head,__ATOMIC_RELAXED);
+    space=SER_RING_SIZE-(head-__atomic_load_n(&ser_tail,__ATOMIC_ACQUIRE));
+    //full, let the kernel hold on to it until the consumer catches up,
+    //looking out for the stop meanwhile
+    if(space==0)
+    {
+      if(poll(&pfd[1],1,1)>0) break;
+      continue;
+    }
+    if(poll(pfd,2,-1)<0)
+    {
+      if(errno==EINTR) continue;
+      break;
+    }
+    if(pfd[1].revents) break;
+    r=read(ser_hand,&ser_ring[head&SER_RING_MASK],space);
+    if(r>0)
+    {
+      __atomic_store_n(&ser_head,head+r,__ATOMIC_RELEASE);
+      write(ser_event,&one,sizeof(one));
+    }
+    else if((r==0)||((errno!=EAGAIN)&&(errno!=EINTR)))
+    {
+      //port went away, anyone waiting will time out
+      break;
+    }
+  }
+  return(NULL);
+}
+//-----------------------------------------------------------------------------
+static unsigned char ser_ring_open ( void )
+{
+  int fd;
+  int r;
+  unsigned char *p;
+
+  fd=memfd_create("ser_ring",0);
+  if(fd<0) return(1);
+  if(ftruncate(fd,SER_RING_SIZE))
+  {
+    close(fd);
+    return(1);
+  }
+  p=mmap(NULL,SER_RING_SIZE<<1,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(p==MAP_FAILED)
+  {
+    close(fd);
+    return(1);
+  }
+  //the same pages twice in a row, a read can run off the end
+  if((mmap(p,SER_RING_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED)
+   ||(mmap(p+SER_RING_SIZE,SER_RING_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0)==MAP_FAILED))
+  {
+    fprintf(stderr,"ser ring mmap: error - %s\n",strerror(errno));
+    munmap(p,SER_RING_SIZE<<1);
+    close(fd);
+    return(1);
+  }
+  close(fd);
+  ser_ring=p;
+  ser_head=ser_tail=0;
+  ser_event=eventfd(0,EFD_NONBLOCK);
+  if(ser_event<0)
+  {
+    fprintf(stderr,"eventfd: error - %s\n",strerror(errno));
+    munmap(p,SER_RING_SIZE<<1);
+    return(1);
+  }
+  ser_stop=eventfd(0,EFD_NONBLOCK);
+  if(ser_stop<0)
+  {
+    fprintf(stderr,"eventfd: error - %s\n",strerror(errno));
+    close(ser_event);
+    munmap(p,SER_RING_SIZE<<1);
+    return(1);
+  }
+  //pthread_create() returns the error, errno is left alone
+  r=pthread_create(&ser_thread,NULL,ser_reader,NULL);
+  if(r)
+  {
+    fprintf(stderr,"pthread_create: error - %s\n",strerror(r));
+    close(ser_stop);
+    close(ser_event);
+    munmap(p,SER_RING_SIZE<<1);
+    return(1);
+  }
+  return(0);
+}
+//-----------------------------------------------------------------------------
+static void ser_ring_close ( void )
+{
+  uint64_t one;
+
+  one=1;
+  write(ser_stop,&one,sizeof(one));
+  pthread_join(ser_thread,NULL);
+  close(ser_stop);
+  close(ser_event);
+  munmap(ser_ring,SER_RING_SIZE<<1);
+}
+//-----------------------------------------------------------------------------
+static int tty_open ( char *dev, unsigned int baud )
+{
+  struct termios options;
+  struct serial_struct serinfo;
+  int fd;
+
+  //reads never block, callers sleep in poll() instead
+  fd=open(dev,O_RDWR|O_NOCTTY|O_NONBLOCK);
+  if(fd==-1)
+  {
+    fprintf(stderr,"open %s: error - %s\n",dev,strerror(errno));
+    return(-1);
+  }
   bzero(&options,sizeof(options));
   //normal 8N1:
   //options.c_cflag=B38400|CS8|CLOCAL|CREAD;
   //options.c_iflag=IGNPAR;
 //***************** 8E1 **********
-  options.c_cflag=B57600|CS8|CLOCAL|CREAD|PARENB;
+  options.c_cflag=CS8|CLOCAL|CREAD|PARENB;
   options.c_iflag=INPCK;
 //*******************************
-  tcflush(ser_hand,TCIFLUSH);
-  tcsetattr(ser_hand,TCSANOW,&options);
-  ser_maincnt=ser_buffcnt=0;
+  //wake up on the first byte, no inter byte timer
+  options.c_cc[VMIN]=1;
+  options.c_cc[VTIME]=0;
+  tcflush(fd,TCIFLUSH);
+  tcsetattr(fd,TCSANOW,&options);
+  if(tty_setbaud(fd,baud))
+  {
+    close(fd);
+    return(-1);
+  }
+  //usb serial adapters otherwise hold rx data for a latency timer,
+  //not every driver supports it so failure is not an error
+  if(ioctl(fd,TIOCGSERIAL,&serinfo)==0)
+  {
+    serinfo.flags|=ASYNC_LOW_LATENCY;
+    ioctl(fd,TIOCSSERIAL,&serinfo);
+  }
+  return(fd);
+}
+//-----------------------------------------------------------------------------
+static void tty_flush ( int fd )
+{
+  tcflush(fd,TCIOFLUSH);
+}
+//-----------------------------------------------------------------------------
+//pulse DTR, with DTR wired to NRST this restarts the rom bootloader
+//so its auto baud detection is armed again
+static void tty_dtr ( int fd )
+{
+  int bits;
+
+  bits=TIOCM_DTR;
+  ioctl(fd,TIOCMBIS,&bits);
+  usleep(10000);
+  ioctl(fd,TIOCMBIC,&bits);
+  usleep(100000);
+}
+//-----------------------------------------------------------------------------
+static unsigned int tty_rtt ( int fd )
+{
+  (void)fd;
+  return(0);
+}
+//-----------------------------------------------------------------------------
+//dev is host:port.  every protocol phase is one write(), with Nagle off
+//each goes out as a segment of its own instead of waiting on the ACK
+//of the one before.
+static int tcp_open ( char *dev, unsigned int baud )
+{
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  char host[256];
+  char *port;
+  int fd;
+  int one;
+  int r;
+
+  (void)baud;
+  snprintf(host,sizeof(host),"%s",dev);
+  port=strrchr(host,':');
+  if(port==NULL)
+  {
+    fprintf(stderr,"%s: error - want tcp:host:port\n",dev);
+    return(-1);
+  }
+  *port++=0;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  r=getaddrinfo(host,port,&hints,&res);
+  if(r)
+  {
+    fprintf(stderr,"%s: error - %s\n",dev,gai_strerror(r));
+    return(-1);
+  }
+  fd=-1;
+  for(ai=res;ai;ai=ai->ai_next)
+  {
+    fd=socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
+    if(fd<0) continue;
+    if(connect(fd,ai->ai_addr,ai->ai_addrlen)==0) break;
+    close(fd);
+    fd=-1;
+  }
+  freeaddrinfo(res);
+  if(fd<0)
+  {
+    fprintf(stderr,"connect %s: error - %s\n",dev,strerror(errno));
+    return(-1);
+  }
+  one=1;
+  setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+  setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,&one,sizeof(one));
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+  return(fd);
+}
+//-----------------------------------------------------------------------------
+//rate, framing and DTR belong to the server's port, set them there
+static unsigned char tcp_setbaud ( int fd, unsigned int baud )
+{
+  (void)fd;
+  (void)baud;
+  return(0);
+}
+//-----------------------------------------------------------------------------
+static unsigned char tcp_setparity ( int fd, int even )
+{
+  (void)fd;
+  (void)even;
+  return(0);
+}
+//-----------------------------------------------------------------------------
+static void tcp_flush ( int fd )
+{
+  (void)fd;
+}
+//-----------------------------------------------------------------------------
+static void tcp_dtr ( int fd )
+{
+  (void)fd;
+}
+//-----------------------------------------------------------------------------
+//the kernel's smoothed round trip time in us
+static unsigned int tcp_rtt ( int fd )
+{
+  struct tcp_info ti;
+  socklen_t len;
+
+  len=sizeof(ti);
+  if(getsockopt(fd,IPPROTO_TCP,TCP_INFO,&ti,&len)) return(0);
+  return(ti.tcpi_rtt);
+}
+//-----------------------------------------------------------------------------
+static const struct ser_transport ser_transports[]=
+{
+  { "tcp:", tcp_open, tcp_setbaud, tcp_setparity, tcp_flush, tcp_dtr, tcp_rtt },
+  { "",     tty_open, tty_setbaud, tty_setparity, tty_flush, tty_dtr, tty_rtt },
+};
+//-----------------------------------------------------------------------------
+static const struct ser_transport *ser_trans ( int fd )
+{
+  if((fd>=0)&&(fd<SER_MAX_FD)&&ser_fdt[fd]) return(ser_fdt[fd]);
+  return(&ser_transports[1]);
+}
+//-----------------------------------------------------------------------------
+//open and configure a port without touching the ser_ globals, for
+//callers that drive several ports themselves, returns -1 on error
+int ser_open_fd ( char *dev, unsigned int baud )
+{
+  const struct ser_transport *t;
+  unsigned int ra;
+  int fd;
+
+  for(ra=0;;ra++)
+  {
+    t=&ser_transports[ra];
+    if(strncmp(dev,t->prefix,strlen(t->prefix))==0) break;
+  }
+  fd=t->open(dev+strlen(t->prefix),baud);
+  if((fd>=0)&&(fd<SER_MAX_FD)) ser_fdt[fd]=t;
+  return(fd);
+}
+//-----------------------------------------------------------------------------
+unsigned char ser_setbaud_fd ( int fd, unsigned int baud )
+{
+  return(ser_trans(fd)->setbaud(fd,baud));
+}
+//-----------------------------------------------------------------------------
+unsigned char ser_setbaud ( unsigned int baud )
+{
+  return(ser_setbaud_fd(ser_hand,baud));
+}
+//-----------------------------------------------------------------------------
+unsigned char ser_setparity_fd ( int fd, int even )
+{
+  return(ser_trans(fd)->setparity(fd,even));
+}
+//-----------------------------------------------------------------------------
+unsigned char ser_setparity ( int even )
+{
+  return(ser_setparity_fd(ser_hand,even));
+}
+//-----------------------------------------------------------------------------
+//round trip time of the link in us, 0 for a local port
+unsigned int ser_rtt_fd ( int fd )
+{
+  return(ser_trans(fd)->rtt(fd));
+}
+//-----------------------------------------------------------------------------
+unsigned int ser_rtt ( void )
+{
+  return(ser_rtt_fd(ser_hand));
+}
+//-----------------------------------------------------------------------------
+void ser_close_fd ( int fd )
+{
+  if((fd>=0)&&(fd<SER_MAX_FD)) ser_fdt[fd]=NULL;
+  close(fd);
+}
+//-----------------------------------------------------------------------------
+unsigned char ser_open ( char *dev, unsigned int baud )
+{
+  ser_hand=ser_open_fd(dev,baud);
+  if(ser_hand==-1) return(1);
+  if(ser_ring_open())
+  {
+    ser_close_fd(ser_hand);
+    return(1);
+  }
 
   return(0);
 }
+//-----------------------------------------------------------------------------
+void strobedtr ( void )
+{
+  ser_trans(ser_hand)->dtr(ser_hand);
+}
+//-----------------------------------------------------------------------------
+//drop anything received or queued but not yet sent
+void ser_flush ( void )
+{
+  ser_trans(ser_hand)->flush(ser_hand);
+  __atomic_store_n(&ser_tail,__atomic_load_n(&ser_head,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+}
 //----------------------------------------------------------------------------
 void ser_close ( void )
 {
-  close(ser_hand);
+  ser_ring_close();
+  ser_close_fd(ser_hand);
+}
+//-----------------------------------------------------------------------------
+//each protocol phase goes out in one write(), the caller then only
+//waits for the response, never for the uart to finish shifting
+int ser_write_fd ( int fd, unsigned char *s, unsigned int len )
+{
+  struct pollfd pfd;
+  int r;
+
+  while(len)
+  {
+    r=write(fd,s,len);
+    if(r>0)
+    {
+      s+=r;
+      len-=r;
+      continue;
+    }
+    if((r<0)&&(errno!=EAGAIN)&&(errno!=EINTR))
+    {
+      fprintf(stderr,"write: error - %s\n",strerror(errno));
+      return(1);
+    }
+    pfd.fd=fd;
+    pfd.events=POLLOUT;
+    poll(&pfd,1,-1);
+  }
+  return(0);
 }
 //-----------------------------------------------------------------------------
 void ser_senddata ( unsigned char *s, unsigned short len )
 {
-  write(ser_hand,s,len);
-  tcdrain(ser_hand);
+  ser_write_fd(ser_hand,s,len);
+  if(ser_drain) tcdrain(ser_hand);
 }
 //-----------------------------------------------------------------------------
 void ser_sendstring ( char *s )
 {
-  write(ser_hand,s,strlen(s));
-  tcdrain(ser_hand);
+  ser_senddata((unsigned char *)s,strlen(s));
 }
 //-----------------------------------------------------------------------------
-void ser_update ( void )
+//put back the old tcdrain() after every send, only for comparing
+void ser_set_drain ( int x )
 {
-  int r;
+  ser_drain=x;
+}
+//-----------------------------------------------------------------------------
+static unsigned int ser_avail ( void )
+{
+    return(__atomic_load_n(&ser_head,__ATOMIC_ACQUIRE)-ser_tail);
+}
+//-----------------------------------------------------------------------------
+//wait until at least len bytes are buffered or ms milliseconds pass,
+//returns the number of bytes buffered
+unsigned int ser_wait ( unsigned int len, unsigned int ms )
+{
+    struct pollfd pfd;
+    struct timespec now;
+    struct timespec end;
+    uint64_t count;
+    long left;
 
-  r=read(ser_hand,&ser_buffer[ser_maincnt],4000);
-  if(r>0)
-  {
-    ser_maincnt+=r;
-    if(ser_maincnt>0xFFF)
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    end.tv_sec+=ms/1000;
+    end.tv_nsec+=(ms%1000)*1000000L;
+    if(end.tv_nsec>=1000000000L)
     {
-      ser_maincnt&=0xFFF;
-      memcpy(ser_buffer,&ser_buffer[0xFFF+1],ser_maincnt);
+        end.tv_sec++;
+        end.tv_nsec-=1000000000L;
     }
-  }
+    while(1)
+    {
+        if(ser_avail()>=len) break;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        left=(end.tv_sec-now.tv_sec)*1000L+(end.tv_nsec-now.tv_nsec)/1000000L;
+        if(left<=0) break;
+        pfd.fd=ser_event;
+        pfd.events=POLLIN;
+        if(poll(&pfd,1,left)<0)
+        {
+            if(errno==EINTR) continue;
+            break;
+        }
+        read(ser_event,&count,sizeof(count));
+    }
+    return(ser_avail());
 }
 //-----------------------------------------------------------------------------
-unsigned short ser_copystring ( unsigned char *d )
+//pointer to the next len received bytes, in place in the ring, or NULL
+//if they do not show up within ms, ser_dump() them when done
+unsigned char *ser_peek ( unsigned int len, unsigned int ms )
 {
-    unsigned short r;
-    unsigned short buffcnt;
-    unsigned short maincnt;
+    if(len>SER_RING_SIZE) return(NULL);
+    if(ser_wait(len,ms)<len) return(NULL);
+    return(&ser_ring[ser_tail&SER_RING_MASK]);
+}
+//-----------------------------------------------------------------------------
+//copy and consume up to len bytes, waiting at most ms for them to arrive
+unsigned int ser_recv ( unsigned char *d, unsigned int len, unsigned int ms )
+{
+    unsigned int r;
 
-    ser_update();
-    buffcnt=ser_buffcnt;
-    maincnt=ser_maincnt;
-    for(r=0;buffcnt!=maincnt;buffcnt=(buffcnt+1)&0xFFF,r++) *d++=ser_buffer[buffcnt];
+    r=ser_wait(len,ms);
+    if(r>len) r=len;
+    memcpy(d,&ser_ring[ser_tail&SER_RING_MASK],r);
+    __atomic_store_n(&ser_tail,ser_tail+r,__ATOMIC_RELEASE);
     return(r);
 }
 //-----------------------------------------------------------------------------
-unsigned short ser_dump ( unsigned short x )
+unsigned int ser_dump ( unsigned int x )
 {
-    unsigned short r;
+    unsigned int r;
 
-    for(r=0;r<x;r++)
-    {
-        if(ser_buffcnt==ser_maincnt) break;
-        ser_buffcnt=(ser_buffcnt+1)&0xFFF;
-    }
+    r=ser_avail();
+    if(x<r) r=x;
+    __atomic_store_n(&ser_tail,ser_tail+r,__ATOMIC_RELEASE);
     return(r);
 }
 //-----------------------------------------------------------------------------
 // Copyright (C) David Welch, 2000
 //-----------------------------------------------------------------------------
-
@@ -3,14 +3,26 @@
 // Copyright (c) David Welch 1996
 //-----------------------------------------------------------------------------
 
-unsigned char ser_open ( void );
+unsigned char ser_open ( char *dev, unsigned int baud );
+unsigned char ser_setbaud ( unsigned int baud );
+int ser_open_fd ( char *dev, unsigned int baud );
+unsigned char ser_setbaud_fd ( int fd, unsigned int baud );
+unsigned char ser_setparity ( int even );
+unsigned char ser_setparity_fd ( int fd, int even );
+unsigned int ser_rtt ( void );
+unsigned int ser_rtt_fd ( int fd );
+void ser_close_fd ( int fd );
+int ser_write_fd ( int fd, unsigned char *s, unsigned int len );
+void ser_flush ( void );
 void strobedtr ( void );
 void ser_close ( void );
 void ser_senddata ( unsigned char *, unsigned short );
 void ser_sendstring ( char *s );
-void ser_update ( void );
-unsigned short ser_copystring ( unsigned char * );
-unsigned short ser_dump ( unsigned short );
+void ser_set_drain ( int x );
+unsigned int ser_dump ( unsigned int );
+unsigned int ser_wait ( unsigned int len, unsigned int ms );
+unsigned char *ser_peek ( unsigned int len, unsigned int ms );
+unsigned int ser_recv ( unsigned char *d, unsigned int len, unsigned int ms );
 
 //-----------------------------------------------------------------------------
 // Copyright (c) David Welch 1996
@@ -0,0 +1,25 @@
+
+//-----------------------------------------------------------------------------
+// arbitrary baud rates through termios2/BOTHER
+//
+// asm/termbits.h and termios.h can not share a translation unit, so
+// this lives apart from ser.c
+//-----------------------------------------------------------------------------
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+//-----------------------------------------------------------------------------
+int ser_custombaud ( int fd, unsigned int baud )
+{
+  struct termios2 tio;
+
+  if(ioctl(fd,TCGETS2,&tio)) return(1);
+  tio.c_cflag&=~(CBAUD|(CBAUD<<IBSHIFT));
+  tio.c_cflag|=BOTHER|(BOTHER<<IBSHIFT);
+  tio.c_ispeed=baud;
+  tio.c_ospeed=baud;
+  if(ioctl(fd,TCSETS2,&tio)) return(1);
+  return(0);
+}
+//-----------------------------------------------------------------------------
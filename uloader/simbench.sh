@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# time progstm end to end against stmsim for each programming strategy,
+# then multistm against one stmsim per board for $BOARDS boards
+#
+# usage: ./simbench.sh [baud ...]
+#
+# the image programmed is $IMAGE, ../blinker.bin by default, the sram
+# loader row needs $FASTLOAD, ../fastload.bin by default
+#
+
+PROGSTM=${PROGSTM:-./progstm}
+MULTISTM=${MULTISTM:-./multistm}
+STMSIM=${STMSIM:-./stmsim}
+IMAGE=${IMAGE:-../blinker.bin}
+FASTLOAD=${FASTLOAD:-../fastload.bin}
+BOARDS=${BOARDS:-1 2 4 8 16}
+LINK=/tmp/stmsim.$$
+
+[ $# -eq 0 ] && set -- 57600 115200
+
+run ()
+{
+    baud=$1
+    name=$2
+    simopts=$3
+    shift 3
+    $STMSIM -b $baud -l $LINK $simopts > /dev/null 2>&1 &
+    sim=$!
+    while [ ! -e $LINK ]; do sleep 0.01; done
+    start=$(date +%s%N)
+    if $PROGSTM -d $LINK -b $baud "$@" $IMAGE > /dev/null
+    then
+        end=$(date +%s%N)
+        printf "%7u  %-24s %8u ms\n" $baud "$name" $(( (end-start)/1000000 ))
+    else
+        printf "%7u  %-24s   failed\n" $baud "$name"
+    fi
+    kill $sim
+    wait $sim 2> /dev/null
+    rm -f $LINK
+}
+
+scale ()
+{
+    baud=$1
+    n=$2
+    links=""
+    sims=""
+    k=0
+    while [ $k -lt $n ]
+    do
+        $STMSIM -b $baud -l $LINK.$k > /dev/null 2>&1 &
+        sims="$sims $!"
+        links="$links $LINK.$k"
+        k=$((k+1))
+    done
+    for l in $links; do while [ ! -e $l ]; do sleep 0.01; done; done
+    start=$(date +%s%N)
+    if $MULTISTM -b $baud $IMAGE $links > /dev/null
+    then
+        end=$(date +%s%N)
+        printf "%7u  %6u %8u ms\n" $baud $n $(( (end-start)/1000000 ))
+    else
+        printf "%7u  %6u   failed\n" $baud $n
+    fi
+    kill $sims
+    wait $sims 2> /dev/null
+    rm -f $links
+}
+
+printf "%7s  %-24s %11s\n" baud strategy time
+for baud in "$@"
+do
+    run $baud "word write, mass erase" "" -w 4 -m
+    run $baud "block write, mass erase" "" -m
+    run $baud "block write, page erase" ""
+    run $baud "block write, ext erase" "-x"
+    [ -f $FASTLOAD ] && run $baud "sram loader at 1000000" "-F" -F 1000000 -S $FASTLOAD
+done
+
+printf "\n%7s  %6s %11s\n" baud boards time
+for baud in "$@"
+do
+    for n in $BOARDS
+    do
+        scale $baud $n
+    done
+done
@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# correctness checks of progstm and multistm against stmsim
+#
+# usage: ./simcheck.sh
+#
+# each check prints ok or FAILED, the exit status is the number failed
+#
+
+PROGSTM=${PROGSTM:-./progstm}
+MULTISTM=${MULTISTM:-./multistm}
+STMSIM=${STMSIM:-./stmsim}
+TMP=/tmp/simcheck.$$
+LINK=$TMP/link
+#stmsim paces itself to the baud rate, the readouts are 128K
+BAUD=${BAUD:-921600}
+failed=0
+
+mkdir -p $TMP
+#keep the journal and capability cache out of the real home
+HOME=$TMP
+export HOME
+
+#extra stmsim options go in $1
+sim_start ()
+{
+    $STMSIM -b $BAUD $1 -l $LINK > /dev/null 2>&1 &
+    sim=$!
+    while [ ! -e $LINK ]; do sleep 0.01; done
+}
+
+sim_stop ()
+{
+    kill $sim
+    wait $sim 2> /dev/null
+    rm -f $LINK
+}
+
+#intel hex data records of file $1 at offset $2 in the 64K segment
+ihex ()
+{
+    od -An -v -tu1 $1 | awk -v base=$2 '
+    { for(i=1;i<=NF;i++) b[n++]=$i }
+    END {
+        for(a=0;a<n;a+=16)
+        {
+            m=((n-a)<16)?(n-a):16
+            o=base+a
+            s=m+int(o/256)+(o%256)
+            printf(":%02X%04X00",m,o)
+            for(i=0;i<m;i++) { printf("%02X",b[a+i]); s+=b[a+i] }
+            printf("%02X\n",(256-(s%256))%256)
+        }
+    }'
+}
+
+check ()
+{
+    if [ "$2" = 0 ]
+    then
+        printf "%-48s ok\n" "$1"
+    else
+        printf "%-48s FAILED\n" "$1"
+        failed=$((failed+1))
+    fi
+}
+
+#2K of 0x55 at the start of flash, then 1K of 0xAA to sram, the flash
+#pages with the same numbers as the sram address must not be erased
+head -c 2048 /dev/zero | tr '\0' '\125' > $TMP/flash.bin
+head -c 1024 /dev/zero | tr '\0' '\252' > $TMP/sram.bin
+
+sim_start
+$PROGSTM -d $LINK -b $BAUD -q -f $TMP/flash.bin > /dev/null
+$PROGSTM -d $LINK -b $BAUD -q -f -a 0x20000400 $TMP/sram.bin > /dev/null
+r=$?
+$PROGSTM -d $LINK -b $BAUD -q -O $TMP/out.bin > /dev/null
+head -c 2048 $TMP/out.bin | cmp -s - $TMP/flash.bin
+check "progstm sram load leaves flash alone" $((r+$?))
+sim_stop
+
+sim_start
+$PROGSTM -d $LINK -b $BAUD -q -f $TMP/flash.bin > /dev/null
+$MULTISTM -b $BAUD -a 0x20000400 $TMP/sram.bin $LINK > /dev/null
+r=$?
+$PROGSTM -d $LINK -b $BAUD -q -O $TMP/out.bin > /dev/null
+head -c 2048 $TMP/out.bin | cmp -s - $TMP/flash.bin
+check "multistm sram load leaves flash alone" $((r+$?))
+sim_stop
+
+#a raw binary that is sparse on disk, the hole has to go in as zeros
+head -c 1024 /dev/zero | tr '\0' '\125' > $TMP/sparse.bin
+truncate -s 9216 $TMP/sparse.bin
+printf 'tail' >> $TMP/sparse.bin
+
+sim_start
+$PROGSTM -d $LINK -b $BAUD -q -f $TMP/sparse.bin > /dev/null
+r=$?
+$PROGSTM -d $LINK -b $BAUD -q -O $TMP/out.bin > /dev/null
+head -c 9220 $TMP/out.bin | cmp -s - $TMP/sparse.bin
+check "sparse raw binary holes programmed as zeros" $((r+$?))
+
+#erased flash reads out as 0xFF unless -H asks for holes.  the file is
+#as long either way, with holes it takes up next to no disk.
+tail -c +9221 $TMP/out.bin | tr -d '\377' | cmp -s - /dev/null
+r=$?
+$PROGSTM -d $LINK -b $BAUD -q -H -O $TMP/holes.bin > /dev/null
+head -c 9220 $TMP/holes.bin | cmp -s - $TMP/sparse.bin
+r=$((r+$?))
+[ $(du -k $TMP/holes.bin | cut -f1) -lt 64 ]
+check "readout erased flash as 0xFF, holes with -H" $((r+$?))
+sim_stop
+
+#the third block ACKs but does not take, the verify finds it and has
+#its page rewritten.  a session that fails anyway leaves the page out
+#of the journal, so running again must work too.
+head -c 4096 /dev/urandom > $TMP/weak.bin
+
+sim_start "-w 3"
+$PROGSTM -d $LINK -b $BAUD -q $TMP/weak.bin > /dev/null 2>&1
+$PROGSTM -d $LINK -b $BAUD -q $TMP/weak.bin > /dev/null
+r=$?
+$PROGSTM -d $LINK -b $BAUD -q -O $TMP/out.bin > /dev/null
+head -c 4096 $TMP/out.bin | cmp -s - $TMP/weak.bin
+check "a write the verify finds bad is rewritten" $((r+$?))
+sim_stop
+
+#two segments sharing flash page 0, the bad block is the first of the
+#second one.  rewriting the page has to put the first one back as well.
+head -c 512 /dev/urandom > $TMP/sega.bin
+head -c 512 /dev/urandom > $TMP/segb.bin
+(
+    echo ":020000040800F2"
+    ihex $TMP/sega.bin 0
+    ihex $TMP/segb.bin 768
+    echo ":00000001FF"
+) > $TMP/two.hex
+
+sim_start "-w 3"
+$PROGSTM -d $LINK -b $BAUD -q -f $TMP/two.hex > /dev/null
+r=$?
+$PROGSTM -d $LINK -b $BAUD -q -O $TMP/out.bin > /dev/null
+cmp -s -n 512 $TMP/out.bin $TMP/sega.bin && cmp -s -n 512 -i 768:0 $TMP/out.bin $TMP/segb.bin
+check "a rewritten page keeps the other segment in it" $((r+$?))
+sim_stop
+
+rm -rf $TMP
+exit $failed
@@ -0,0 +1,235 @@
+
+//-----------------------------------------------------------------------------
+// programming phase timing and per command latency histograms
+//
+// everything is CLOCK_MONOTONIC microseconds.  a command's latency runs
+// from its first byte going out to the last ACK coming back, bucket n
+// of its histogram counts latencies from 2^n up to 2^(n+1) us.
+//
+// over a network link every wait for the bootloader's answer also pays
+// the link's round trip, that share is estimated from the tcp rtt.
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define BUCKETS 32
+
+struct phase_stat
+{
+    unsigned long long start;
+    unsigned long long us;
+    unsigned long long bytes;
+    unsigned int used;
+};
+
+struct cmd_stat
+{
+    unsigned int count;
+    unsigned int retries;
+    unsigned long long total;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned int hist[BUCKETS];
+};
+
+static const char *phase_name[PH_COUNT]=
+{
+    "detect","erase","upload","write","verify","go","readout"
+};
+
+static struct phase_stat phase[PH_COUNT];
+static struct cmd_stat cmd[STAT_CMDS];
+static unsigned long long first;
+static unsigned int roundtrips;
+static unsigned int link_rtt;
+
+//-----------------------------------------------------------------------------
+unsigned long long stats_now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return(((unsigned long long)ts.tv_sec)*1000000ULL+(ts.tv_nsec/1000));
+}
+//-----------------------------------------------------------------------------
+static const char *cmd_name ( unsigned int c )
+{
+    switch(c)
+    {
+        case 0x00: return("Get");
+        case 0x01: return("Get Version");
+        case 0x02: return("Get ID");
+        case 0x11: return("Read Memory");
+        case 0x21: return("Go");
+        case 0x31: return("Write Memory");
+        case 0x43: return("Erase");
+        case 0x44: return("Extended Erase");
+        case 0x7F: return("Sync");
+        case 0x92: return("Readout Unprotect");
+        case STAT_FAST_WRITE: return("Loader Write");
+        case STAT_FAST_CRC: return("Loader CRC");
+    }
+    return("Unknown");
+}
+//-----------------------------------------------------------------------------
+//a phase may be entered more than once, the time adds up
+void stats_begin ( unsigned int p )
+{
+    phase[p].start=stats_now();
+    if(first==0) first=phase[p].start;
+}
+//-----------------------------------------------------------------------------
+void stats_end ( unsigned int p, unsigned int bytes )
+{
+    phase[p].us+=stats_now()-phase[p].start;
+    phase[p].bytes+=bytes;
+    phase[p].used=1;
+}
+//-----------------------------------------------------------------------------
+void stats_cmd ( unsigned int c, unsigned long long us )
+{
+    struct cmd_stat *s;
+    unsigned int b;
+
+    if(c>=STAT_CMDS) return;
+    s=&cmd[c];
+    if((s->count==0)||(us<s->min)) s->min=us;
+    if(us>s->max) s->max=us;
+    s->count++;
+    s->total+=us;
+    for(b=0;((2ULL<<b)<=us)&&(b<(BUCKETS-1));b++) continue;
+    s->hist[b]++;
+}
+//-----------------------------------------------------------------------------
+void stats_retry ( unsigned int c )
+{
+    if(c<STAT_CMDS) cmd[c].retries++;
+}
+//-----------------------------------------------------------------------------
+//a send that has to be answered before the next one
+void stats_roundtrip ( void )
+{
+    roundtrips++;
+}
+//-----------------------------------------------------------------------------
+void stats_link ( unsigned int rtt_us )
+{
+    link_rtt=rtt_us;
+}
+//-----------------------------------------------------------------------------
+static unsigned long long rate ( unsigned long long bytes, unsigned long long us )
+{
+    if(us==0) return(0);
+    return((bytes*1000000ULL)/us);
+}
+//-----------------------------------------------------------------------------
+static void summary_text ( const char *dev, unsigned int baud, unsigned int chip, unsigned int bytes, int result, unsigned long long total )
+{
+    struct cmd_stat *s;
+    unsigned int ra,rb;
+    unsigned long long net;
+
+    printf("%s %u baud chip 0x%04X %u bytes %s in %llu.%03llu ms\n",
+        dev,baud,chip,bytes,result?"failed":"ok",total/1000,total%1000);
+    for(ra=0;ra<PH_COUNT;ra++)
+    {
+        if(!phase[ra].used) continue;
+        printf("  %-7s %8llu.%03llu ms %8llu bytes %8llu bytes/s\n",phase_name[ra],
+            phase[ra].us/1000,phase[ra].us%1000,phase[ra].bytes,rate(phase[ra].bytes,phase[ra].us));
+    }
+    if(link_rtt)
+    {
+        net=(unsigned long long)link_rtt*roundtrips;
+        printf("  link    rtt %u us x %u round trips, %llu.%03llu ms on the network\n",
+            link_rtt,roundtrips,net/1000,net%1000);
+    }
+    for(ra=0;ra<STAT_CMDS;ra++)
+    {
+        s=&cmd[ra];
+        if((s->count==0)&&(s->retries==0)) continue;
+        printf("  0x%02X %-17s %6u x  min %6llu  avg %6llu  max %6llu us",ra&0xFF,cmd_name(ra),
+            s->count,s->min,s->count?(s->total/s->count):0,s->max);
+        if(s->retries) printf("  %u retried",s->retries);
+        printf("\n");
+        printf("      ");
+        for(rb=0;rb<BUCKETS;rb++)
+        {
+            if(s->hist[rb]) printf(" <%lluus:%u",2ULL<<rb,s->hist[rb]);
+        }
+        printf("\n");
+    }
+}
+//-----------------------------------------------------------------------------
+//a json string, quotes, backslashes and control characters escaped
+static void json_string ( const char *s )
+{
+    unsigned int c;
+
+    putchar('"');
+    for(;*s;s++)
+    {
+        c=*(const unsigned char *)s;
+        if((c=='"')||(c=='\\')) printf("\\%c",c);
+        else if(c<0x20) printf("\\u%04X",c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+//-----------------------------------------------------------------------------
+static void summary_json ( const char *dev, unsigned int baud, unsigned int chip, unsigned int bytes, int result, unsigned long long total )
+{
+    struct cmd_stat *s;
+    unsigned int ra,rb;
+    const char *sep;
+    const char *hsep;
+
+    printf("{\"device\":");
+    json_string(dev);
+    printf(",\"baud\":%u,\"chip_id\":%u,\"image_bytes\":%u,\"result\":\"%s\",\"total_us\":%llu,",
+        baud,chip,bytes,result?"failed":"ok",total);
+    printf("\"rtt_us\":%u,\"round_trips\":%u,\"network_us\":%llu,",
+        link_rtt,roundtrips,(unsigned long long)link_rtt*roundtrips);
+    printf("\"phases\":[");
+    sep="";
+    for(ra=0;ra<PH_COUNT;ra++)
+    {
+        if(!phase[ra].used) continue;
+        printf("%s{\"name\":\"%s\",\"us\":%llu,\"bytes\":%llu,\"bytes_per_s\":%llu}",sep,phase_name[ra],
+            phase[ra].us,phase[ra].bytes,rate(phase[ra].bytes,phase[ra].us));
+        sep=",";
+    }
+    printf("],\"commands\":[");
+    sep="";
+    for(ra=0;ra<STAT_CMDS;ra++)
+    {
+        s=&cmd[ra];
+        if((s->count==0)&&(s->retries==0)) continue;
+        printf("%s{\"cmd\":%u,\"name\":\"%s\",\"count\":%u,\"retries\":%u,\"min_us\":%llu,\"avg_us\":%llu,\"max_us\":%llu,\"hist\":{",
+            sep,ra,cmd_name(ra),s->count,s->retries,s->min,s->count?(s->total/s->count):0,s->max);
+        hsep="";
+        for(rb=0;rb<BUCKETS;rb++)
+        {
+            if(s->hist[rb]==0) continue;
+            printf("%s\"%llu\":%u",hsep,2ULL<<rb,s->hist[rb]);
+            hsep=",";
+        }
+        printf("}}");
+        sep=",";
+    }
+    printf("]}\n");
+}
+//-----------------------------------------------------------------------------
+void stats_summary ( int json, const char *dev, unsigned int baud, unsigned int chip, unsigned int bytes, int result )
+{
+    unsigned long long total;
+
+    total=first?(stats_now()-first):0;
+    if(json) summary_json(dev,baud,chip,bytes,result,total);
+    else     summary_text(dev,baud,chip,bytes,result,total);
+    fflush(stdout);
+}
+//-----------------------------------------------------------------------------
@@ -0,0 +1,31 @@
+
+//-----------------------------------------------------------------------------
+// programming phase timing and per command latency histograms
+//-----------------------------------------------------------------------------
+
+enum
+{
+    PH_DETECT,
+    PH_ERASE,
+    PH_UPLOAD,
+    PH_WRITE,
+    PH_VERIFY,
+    PH_GO,
+    PH_READOUT,
+    PH_COUNT
+};
+
+//bootloader command bytes, then the sram loader's frame types
+#define STAT_FAST_WRITE 0x100
+#define STAT_FAST_CRC   0x101
+#define STAT_CMDS       0x102
+
+unsigned long long stats_now ( void );
+void stats_begin ( unsigned int phase );
+void stats_end ( unsigned int phase, unsigned int bytes );
+void stats_cmd ( unsigned int cmd, unsigned long long us );
+void stats_retry ( unsigned int cmd );
+void stats_roundtrip ( void );
+void stats_link ( unsigned int rtt_us );
+void stats_summary ( int json, const char *dev, unsigned int baud, unsigned int chip, unsigned int bytes, int result );
+
@@ -0,0 +1,758 @@
+
+//-----------------------------------------------------------------------------
+// stm32 usart rom bootloader simulator
+//
+// creates a pseudo terminal and speaks the AN3155 protocol on it so
+// progstm can be exercised and timed without a board.  the line rate
+// and the flash erase/program times are modelled by sleeping before
+// each response for as long as the real part would have taken.
+//
+// with -F a Go into sram is taken to start ../fastload.c, whose frame
+// protocol is then spoken at the rate progstm put in its parameters.
+// with -A a Go into flash prints a numbered boot log at the line rate,
+// for trying progstm's console.
+//
+// with -t it listens on a tcp port instead, standing in for a raw tcp
+// serial server (progstm -d tcp:host:port), -R adds the network's round
+// trip to every response.
+//-----------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define ACK  0x79
+#define NACK 0x1F
+
+#define FLASH_BASE      0x08000000
+#define FLASH_SIZE      0x20000
+#define FLASH_PAGE_SIZE 0x400
+#define SRAM_BASE       0x20000000
+#define SRAM_SIZE       0x2000
+//the rom keeps its own variables here, writes are refused
+#define SRAM_ROM_USED   0x200
+//flash size in K and the unique id, read only
+#define DEVINFO_BASE    0x1FFFF7E0
+#define DEVINFO_SIZE    0x20
+
+//fastload.c
+#define FASTPARM        0x20001C00
+#define FAST_SOF        0xA5
+#define FAST_REPLY      0x5A
+#define FAST_WRITE      0x57
+#define FAST_CRC        0x43
+#define FAST_FRAME_MAX  1024
+
+int master;
+int slave;
+int listen_fd;
+
+unsigned char flash[FLASH_SIZE];
+unsigned char sram[SRAM_SIZE];
+unsigned char devinfo[DEVINFO_SIZE];
+
+unsigned char rbuf[FAST_FRAME_MAX+16];
+unsigned char tbuf[300];
+
+unsigned int baud;
+unsigned int erase_us;
+unsigned int prog_us;
+unsigned int extended;
+unsigned int protect;
+unsigned int verbose;
+unsigned int fastload;
+unsigned int app_lines;
+unsigned int corrupt;
+unsigned int net_us;
+unsigned int noise;
+unsigned int weak_write;
+unsigned int flash_writes;
+
+unsigned int synced;
+unsigned long long line_bytes;
+unsigned long long work_us;
+
+//-----------------------------------------------------------------------------
+void sleep_us ( unsigned long long us )
+{
+    struct timespec ts;
+
+    ts.tv_sec=us/1000000;
+    ts.tv_nsec=(us%1000000)*1000;
+    while(nanosleep(&ts,&ts)) continue;
+}
+//-----------------------------------------------------------------------------
+void tcp_accept ( void )
+{
+    int one;
+
+    if(master>=0) close(master);
+    while(1)
+    {
+        master=accept(listen_fd,NULL,NULL);
+        if(master>=0) break;
+        if(errno!=EINTR)
+        {
+            fprintf(stderr,"accept: error - %s\n",strerror(errno));
+            exit(1);
+        }
+    }
+    one=1;
+    setsockopt(master,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    fprintf(stderr,"client connected\n");
+}
+//-----------------------------------------------------------------------------
+int tcp_listen ( unsigned int port )
+{
+    struct sockaddr_in sa;
+    int one;
+
+    listen_fd=socket(AF_INET,SOCK_STREAM,0);
+    if(listen_fd<0) return(1);
+    one=1;
+    setsockopt(listen_fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family=AF_INET;
+    sa.sin_port=htons(port);
+    sa.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    if(bind(listen_fd,(struct sockaddr *)&sa,sizeof(sa))) return(1);
+    if(listen(listen_fd,1)) return(1);
+    //a client gone mid response is not fatal
+    signal(SIGPIPE,SIG_IGN);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned int getbyte ( void )
+{
+    unsigned char c;
+    int r;
+
+    while(1)
+    {
+        r=read(master,&c,1);
+        if(r==1) break;
+        //the tcp client went away, wait for the next one
+        if((r<=0)&&(listen_fd>=0)) tcp_accept();
+    }
+    line_bytes++;
+    if(noise&&((rand()%noise)==0)) c^=1<<(rand()&7);
+    return(c);
+}
+//-----------------------------------------------------------------------------
+void getbytes ( unsigned char *d, unsigned int len )
+{
+    while(len--) *d++=getbyte();
+}
+//-----------------------------------------------------------------------------
+//8E1 is 11 bits a byte, the whole exchange since the last response
+//plus whatever flash work was done is paid for before replying
+void respond ( unsigned char *s, unsigned int len )
+{
+    unsigned long long us;
+
+    line_bytes+=len;
+    us=work_us+net_us;
+    if(baud) us+=(line_bytes*11ULL*1000000ULL)/baud;
+    if(us) sleep_us(us);
+    line_bytes=0;
+    work_us=0;
+    write(master,s,len);
+}
+//-----------------------------------------------------------------------------
+//the loader takes in the next frames while it programs this one, so
+//only the longer of the line time and the flash time is paid
+void respond_overlapped ( unsigned char *s, unsigned int len )
+{
+    unsigned long long us;
+
+    line_bytes+=len;
+    us=0;
+    if(baud) us=(line_bytes*11ULL*1000000ULL)/baud;
+    if(work_us>us) us=work_us;
+    us+=net_us;
+    if(us) sleep_us(us);
+    line_bytes=0;
+    work_us=0;
+    write(master,s,len);
+}
+//-----------------------------------------------------------------------------
+void ack ( void )
+{
+    tbuf[0]=ACK;
+    respond(tbuf,1);
+}
+//-----------------------------------------------------------------------------
+void nack ( void )
+{
+    tbuf[0]=NACK;
+    respond(tbuf,1);
+}
+//-----------------------------------------------------------------------------
+unsigned int xor_ok ( unsigned char *s, unsigned int len )
+{
+    unsigned int ra,rc;
+
+    rc=0;
+    for(ra=0;ra<=len;ra++) rc^=s[ra];
+    return(rc==0);
+}
+//-----------------------------------------------------------------------------
+//4 address bytes plus checksum, returns 1 and NACKs if bad
+int get_address ( unsigned int *add )
+{
+    getbytes(rbuf,5);
+    if(!xor_ok(rbuf,4))
+    {
+        nack();
+        return(1);
+    }
+    *add=(rbuf[0]<<24)|(rbuf[1]<<16)|(rbuf[2]<<8)|rbuf[3];
+    return(0);
+}
+//-----------------------------------------------------------------------------
+unsigned char *mem_ptr ( unsigned int add, unsigned int len, int write )
+{
+    if((add>=FLASH_BASE)&&((add+len)<=(FLASH_BASE+FLASH_SIZE))) return(&flash[add-FLASH_BASE]);
+    if(write&&(add<(SRAM_BASE+SRAM_ROM_USED))) return(NULL);
+    if((add>=SRAM_BASE)&&((add+len)<=(SRAM_BASE+SRAM_SIZE))) return(&sram[add-SRAM_BASE]);
+    if(write) return(NULL);
+    if((add>=DEVINFO_BASE)&&((add+len)<=(DEVINFO_BASE+DEVINFO_SIZE))) return(&devinfo[add-DEVINFO_BASE]);
+    return(NULL);
+}
+//-----------------------------------------------------------------------------
+void erase_page ( unsigned int page )
+{
+    if(page>=(FLASH_SIZE/FLASH_PAGE_SIZE)) return;
+    memset(&flash[page*FLASH_PAGE_SIZE],0xFF,FLASH_PAGE_SIZE);
+    work_us+=erase_us;
+}
+//-----------------------------------------------------------------------------
+void mass_erase ( void )
+{
+    memset(flash,0xFF,sizeof(flash));
+    work_us+=erase_us;
+}
+//-----------------------------------------------------------------------------
+void cmd_get ( void )
+{
+    unsigned int ra;
+
+    ra=0;
+    tbuf[ra++]=ACK;
+    tbuf[ra++]=11;
+    tbuf[ra++]=0x22;
+    tbuf[ra++]=0x00;
+    tbuf[ra++]=0x01;
+    tbuf[ra++]=0x02;
+    tbuf[ra++]=0x11;
+    tbuf[ra++]=0x21;
+    tbuf[ra++]=0x31;
+    tbuf[ra++]=extended?0x44:0x43;
+    tbuf[ra++]=0x63;
+    tbuf[ra++]=0x73;
+    tbuf[ra++]=0x82;
+    tbuf[ra++]=0x92;
+    tbuf[ra++]=ACK;
+    respond(tbuf,ra);
+}
+//-----------------------------------------------------------------------------
+void cmd_get_version ( void )
+{
+    tbuf[0]=ACK;
+    tbuf[1]=0x22;
+    tbuf[2]=0x00;
+    tbuf[3]=0x00;
+    tbuf[4]=ACK;
+    respond(tbuf,5);
+}
+//-----------------------------------------------------------------------------
+void cmd_get_id ( void )
+{
+    tbuf[0]=ACK;
+    tbuf[1]=1;
+    tbuf[2]=0x04;
+    tbuf[3]=0x20;
+    tbuf[4]=ACK;
+    respond(tbuf,5);
+}
+//-----------------------------------------------------------------------------
+void cmd_read_memory ( void )
+{
+    unsigned int add;
+    unsigned int len;
+    unsigned char *p;
+
+    if(protect)
+    {
+        nack();
+        return;
+    }
+    ack();
+    if(get_address(&add)) return;
+    ack();
+    getbytes(rbuf,2);
+    if((rbuf[0]^rbuf[1])!=0xFF)
+    {
+        nack();
+        return;
+    }
+    len=rbuf[0]+1;
+    p=mem_ptr(add,len,0);
+    if(p==NULL)
+    {
+        nack();
+        return;
+    }
+    tbuf[0]=ACK;
+    memcpy(&tbuf[1],p,len);
+    respond(tbuf,len+1);
+}
+//-----------------------------------------------------------------------------
+void cmd_write_memory ( void )
+{
+    unsigned int ra;
+    unsigned int add;
+    unsigned int len;
+    unsigned char *p;
+
+    if(protect)
+    {
+        nack();
+        return;
+    }
+    ack();
+    if(get_address(&add)) return;
+    ack();
+    rbuf[0]=getbyte();
+    len=rbuf[0]+1;
+    getbytes(&rbuf[1],len+1);
+    if(!xor_ok(rbuf,len+1))
+    {
+        nack();
+        return;
+    }
+    p=mem_ptr(add,len,1);
+    if(p==NULL)
+    {
+        nack();
+        return;
+    }
+    if(p>=flash&&p<(flash+FLASH_SIZE))
+    {
+        //flash bits only go from 1 to 0 without an erase
+        for(ra=0;ra<len;ra++) p[ra]&=rbuf[1+ra];
+        work_us+=((len+1)>>1)*prog_us;
+        //a cell that did not take, it is still ACKed
+        if(++flash_writes==weak_write)
+        {
+            for(ra=0;ra<len;ra++) if(p[ra]!=0xFF) break;
+            if(ra<len) p[ra]|=(~p[ra])&(p[ra]+1);
+        }
+    }
+    else
+    {
+        memcpy(p,&rbuf[1],len);
+    }
+    ack();
+}
+//-----------------------------------------------------------------------------
+void cmd_erase ( void )
+{
+    unsigned int ra;
+    unsigned int len;
+
+    if(extended||protect)
+    {
+        nack();
+        return;
+    }
+    ack();
+    rbuf[0]=getbyte();
+    if(rbuf[0]==0xFF)
+    {
+        rbuf[1]=getbyte();
+        if(rbuf[1]!=0x00)
+        {
+            nack();
+            return;
+        }
+        mass_erase();
+        ack();
+        return;
+    }
+    len=rbuf[0]+1;
+    getbytes(&rbuf[1],len+1);
+    if(!xor_ok(rbuf,len+1))
+    {
+        nack();
+        return;
+    }
+    for(ra=0;ra<len;ra++) erase_page(rbuf[1+ra]);
+    ack();
+}
+//-----------------------------------------------------------------------------
+void cmd_extended_erase ( void )
+{
+    unsigned int ra;
+    unsigned int len;
+    unsigned char pages[0x10000*2+1];
+
+    if((!extended)||protect)
+    {
+        nack();
+        return;
+    }
+    ack();
+    getbytes(rbuf,2);
+    len=(rbuf[0]<<8)|rbuf[1];
+    if(len>=0xFFF0)
+    {
+        //mass and bank erase
+        rbuf[2]=getbyte();
+        if(rbuf[2]!=(rbuf[0]^rbuf[1]))
+        {
+            nack();
+            return;
+        }
+        mass_erase();
+        ack();
+        return;
+    }
+    len++;
+    pages[0]=rbuf[0];
+    pages[1]=rbuf[1];
+    getbytes(&pages[2],(len<<1)+1);
+    if(!xor_ok(pages,(len<<1)+2))
+    {
+        nack();
+        return;
+    }
+    for(ra=0;ra<len;ra++) erase_page((pages[2+(ra<<1)]<<8)|pages[3+(ra<<1)]);
+    ack();
+}
+//-----------------------------------------------------------------------------
+unsigned int crc32 ( unsigned int crc, unsigned char *s, unsigned int len )
+{
+    unsigned int ra;
+
+    while(len--)
+    {
+        crc^=*s++;
+        for(ra=0;ra<8;ra++) crc=(crc>>1)^((crc&1)?0xEDB88320:0);
+    }
+    return(crc);
+}
+//-----------------------------------------------------------------------------
+void fast_reply ( unsigned int seq, unsigned int status, unsigned int crc )
+{
+    unsigned int ra;
+
+    tbuf[0]=FAST_REPLY;
+    tbuf[1]=seq;
+    tbuf[2]=status;
+    for(ra=0;ra<4;ra++) tbuf[3+ra]=(crc>>(ra<<3))&0xFF;
+    tbuf[7]=0;
+    for(ra=0;ra<7;ra++) tbuf[7]^=tbuf[ra];
+    respond_overlapped(tbuf,8);
+}
+//-----------------------------------------------------------------------------
+unsigned int fast_program ( unsigned char *erased, unsigned int add, unsigned char *s, unsigned int len )
+{
+    unsigned int ra;
+    unsigned char *p;
+
+    if((add&1)||(len&1)) return(3);
+    if(len==0) return(0);
+    p=mem_ptr(add,len,1);
+    if((p==NULL)||(p<flash)||(p>=(flash+FLASH_SIZE))) return(3);
+    for(ra=(add-FLASH_BASE)/FLASH_PAGE_SIZE;ra<=((add+len-1-FLASH_BASE)/FLASH_PAGE_SIZE);ra++)
+    {
+        if(erased[ra]) continue;
+        erase_page(ra);
+        erased[ra]=1;
+    }
+    for(ra=0;ra<len;ra+=2)
+    {
+        if((p[ra]==s[ra])&&(p[ra+1]==s[ra+1])) continue;
+        p[ra]&=s[ra];
+        p[ra+1]&=s[ra+1];
+        work_us+=prog_us;
+        if((p[ra]!=s[ra])||(p[ra+1]!=s[ra+1])) return(2);
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
+//never returns, like the real loader only a reset gets the rom back
+void fast_loader ( void )
+{
+    unsigned char erased[FLASH_SIZE/FLASH_PAGE_SIZE];
+    unsigned char *parm;
+    unsigned int len;
+    unsigned int add;
+    unsigned int crc;
+    unsigned int ra;
+    unsigned char *p;
+
+    parm=&sram[FASTPARM-SRAM_BASE];
+    if(baud) baud=parm[0]|(parm[1]<<8)|(parm[2]<<16)|(parm[3]<<24);
+    memset(erased,parm[4]&1,sizeof(erased));
+    fprintf(stderr,"fastload at %u baud\n",baud);
+    line_bytes=0;
+    while(1)
+    {
+        if(getbyte()!=FAST_SOF) continue;
+        getbytes(rbuf,8);
+        len=rbuf[2]|(rbuf[3]<<8);
+        add=rbuf[4]|(rbuf[5]<<8)|(rbuf[6]<<16)|(rbuf[7]<<24);
+        if((len>FAST_FRAME_MAX)||((rbuf[0]!=FAST_WRITE)&&(rbuf[0]!=FAST_CRC))) continue;
+        getbytes(&rbuf[8],len+4);
+        crc=~crc32(0xFFFFFFFF,rbuf,8+len);
+        if(corrupt&&((rand()%corrupt)==0)) crc^=1;
+        if(crc!=(rbuf[8+len]|(rbuf[9+len]<<8)|(rbuf[10+len]<<16)|((unsigned int)rbuf[11+len]<<24)))
+        {
+            fast_reply(rbuf[1],1,0);
+            continue;
+        }
+        if(verbose) fprintf(stderr,"fast 0x%02X 0x%08X %u\n",rbuf[0],add,len);
+        if(rbuf[0]==FAST_WRITE)
+        {
+            fast_reply(rbuf[1],fast_program(erased,add,&rbuf[8],len),0);
+            continue;
+        }
+        ra=rbuf[8]|(rbuf[9]<<8)|(rbuf[10]<<16)|((unsigned int)rbuf[11]<<24);
+        p=mem_ptr(add,ra,0);
+        if(p==NULL) fast_reply(rbuf[1],3,0);
+        else fast_reply(rbuf[1],0,~crc32(0xFFFFFFFF,p,ra));
+    }
+}
+//-----------------------------------------------------------------------------
+//what an application might print as it comes up, numbered so a capture
+//can be checked for lost lines
+void app_boot ( void )
+{
+    unsigned int ra;
+    int len;
+
+    for(ra=0;ra<app_lines;ra++)
+    {
+        len=snprintf((char *)tbuf,sizeof(tbuf),"boot %06u the quick brown fox jumps over the lazy dog\r\n",ra);
+        respond(tbuf,len);
+    }
+}
+//-----------------------------------------------------------------------------
+void cmd_go ( void )
+{
+    unsigned int add;
+
+    if(protect)
+    {
+        nack();
+        return;
+    }
+    ack();
+    if(get_address(&add)) return;
+    if(mem_ptr(add,4,0)==NULL)
+    {
+        nack();
+        return;
+    }
+    ack();
+    fprintf(stderr,"go 0x%08X\n",add);
+    if(fastload&&(add>=SRAM_BASE)) fast_loader();
+    if(app_lines&&(add>=FLASH_BASE)&&(add<FLASH_BASE+FLASH_SIZE)) app_boot();
+    synced=0;
+}
+//-----------------------------------------------------------------------------
+void cmd_readout_unprotect ( void )
+{
+    ack();
+    mass_erase();
+    protect=0;
+    ack();
+    //the part resets after this
+    synced=0;
+}
+//-----------------------------------------------------------------------------
+int pty_open ( char *link )
+{
+    struct termios options;
+
+    master=posix_openpt(O_RDWR|O_NOCTTY);
+    if((master<0)||grantpt(master)||unlockpt(master))
+    {
+        fprintf(stderr,"posix_openpt: error - %s\n",strerror(errno));
+        return(1);
+    }
+    //hold the slave open so the master never sees a hangup between clients
+    slave=open(ptsname(master),O_RDWR|O_NOCTTY);
+    if(slave<0)
+    {
+        fprintf(stderr,"open %s: error - %s\n",ptsname(master),strerror(errno));
+        return(1);
+    }
+    tcgetattr(slave,&options);
+    cfmakeraw(&options);
+    tcsetattr(slave,TCSANOW,&options);
+    if(link)
+    {
+        unlink(link);
+        if(symlink(ptsname(master),link))
+        {
+            fprintf(stderr,"symlink %s: error - %s\n",link,strerror(errno));
+            return(1);
+        }
+    }
+    printf("%s\n",ptsname(master));
+    fflush(stdout);
+    return(0);
+}
+//-----------------------------------------------------------------------------
+void usage ( void )
+{
+    fprintf(stderr,"usage: stmsim [-b baud] [-e erase_us] [-p prog_us] [-x] [-P] [-F [-c n]] [-n n] [-w n] [-A n] [-l link | -t port [-R us]] [-v]\n");
+    fprintf(stderr,"  -b  line rate to model, 0 for no throttling (default 57600)\n");
+    fprintf(stderr,"  -e  page erase time in us (default 20000)\n");
+    fprintf(stderr,"  -p  halfword program time in us (default 52)\n");
+    fprintf(stderr,"  -x  offer Extended Erase (0x44) instead of Erase (0x43)\n");
+    fprintf(stderr,"  -P  start read protected\n");
+    fprintf(stderr,"  -F  a Go into sram starts the fastload protocol\n");
+    fprintf(stderr,"  -c  fail the crc of one loader frame in n, at random\n");
+    fprintf(stderr,"  -n  flip a bit in one received byte in n, at random\n");
+    fprintf(stderr,"  -w  the nth Write Memory to flash leaves a bit unprogrammed\n");
+    fprintf(stderr,"  -A  a Go into flash prints n lines of boot log\n");
+    fprintf(stderr,"  -l  also make a symlink to the pty here\n");
+    fprintf(stderr,"  -t  listen on this tcp port of 127.0.0.1 instead of a pty\n");
+    fprintf(stderr,"  -R  network round trip in us added to every response\n");
+    fprintf(stderr,"  -v  log every command\n");
+}
+//-----------------------------------------------------------------------------
+int main ( int argc, char *argv[] )
+{
+    unsigned int cmd;
+    unsigned int ra;
+    char *link;
+    unsigned int port;
+    int opt;
+
+    baud=57600;
+    erase_us=20000;
+    prog_us=52;
+    extended=0;
+    protect=0;
+    verbose=0;
+    fastload=0;
+    app_lines=0;
+    corrupt=0;
+    noise=0;
+    weak_write=0;
+    flash_writes=0;
+    net_us=0;
+    port=0;
+    link=NULL;
+    while((opt=getopt(argc,argv,"b:e:p:xPFc:n:w:A:l:t:R:vh"))!=-1)
+    {
+        switch(opt)
+        {
+            case 'b': baud=strtoul(optarg,NULL,0); break;
+            case 'e': erase_us=strtoul(optarg,NULL,0); break;
+            case 'p': prog_us=strtoul(optarg,NULL,0); break;
+            case 'x': extended=1; break;
+            case 'P': protect=1; break;
+            case 'F': fastload=1; break;
+            case 'c': corrupt=strtoul(optarg,NULL,0); break;
+            case 'n': noise=strtoul(optarg,NULL,0); break;
+            case 'w': weak_write=strtoul(optarg,NULL,0); break;
+            case 'A': app_lines=strtoul(optarg,NULL,0); break;
+            case 'l': link=optarg; break;
+            case 't': port=strtoul(optarg,NULL,0); break;
+            case 'R': net_us=strtoul(optarg,NULL,0); break;
+            case 'v': verbose=1; break;
+            default:
+                usage();
+                return(1);
+        }
+    }
+
+    master=-1;
+    listen_fd=-1;
+    if(port)
+    {
+        if(tcp_listen(port))
+        {
+            fprintf(stderr,"listen on %u: error - %s\n",port,strerror(errno));
+            return(1);
+        }
+        printf("tcp:127.0.0.1:%u\n",port);
+        fflush(stdout);
+        tcp_accept();
+    }
+    else
+    {
+        if(pty_open(link)) return(1);
+    }
+
+    memset(flash,0xFF,sizeof(flash));
+    memset(sram,0x00,sizeof(sram));
+    memset(devinfo,0xFF,sizeof(devinfo));
+    devinfo[0]=(FLASH_SIZE>>10)&0xFF;
+    devinfo[1]=(FLASH_SIZE>>18)&0xFF;
+    //a unique id of its own for every simulator
+    ra=getpid();
+    memcpy(&devinfo[8],&ra,4);
+    memset(&devinfo[12],0x42,8);
+    synced=0;
+    line_bytes=0;
+    work_us=0;
+    while(1)
+    {
+        cmd=getbyte();
+        if(!synced)
+        {
+            //auto baud, anything but 0x7F is noise
+            if(cmd==0x7F)
+            {
+                synced=1;
+                ack();
+            }
+            line_bytes=0;
+            continue;
+        }
+        if(cmd==0x7F)
+        {
+            nack();
+            continue;
+        }
+        ra=getbyte();
+        if((cmd^ra)!=0xFF)
+        {
+            nack();
+            continue;
+        }
+        if(verbose) fprintf(stderr,"cmd 0x%02X\n",cmd);
+        switch(cmd)
+        {
+            case 0x00: cmd_get(); break;
+            case 0x01: cmd_get_version(); break;
+            case 0x02: cmd_get_id(); break;
+            case 0x11: cmd_read_memory(); break;
+            case 0x21: cmd_go(); break;
+            case 0x31: cmd_write_memory(); break;
+            case 0x43: cmd_erase(); break;
+            case 0x44: cmd_extended_erase(); break;
+            case 0x92: cmd_readout_unprotect(); break;
+            default: nack(); break;
+        }
+    }
+    return(0);
+}
+//-----------------------------------------------------------------------------
@@ -0,0 +1,57 @@
+
+//-----------------------------------------------------------------------------
+// sram resident lz decompressor for stlink-ramload --lz
+//
+// linked with lzmap into the top of sram, the host streams compressed
+// blocks into two staging buffers and hands them over through a
+// mailbox, the stub expands each one at its destination then clears
+// the length to give the buffer back.  mailbox entry n is
+// { dst, len } at LZMBOX+(n*8), dst comes first so a single ascending
+// swd write never shows the stub a length before its address.
+//-----------------------------------------------------------------------------
+
+void PUT32 ( unsigned int, unsigned int );
+unsigned int GET32 ( unsigned int );
+
+#define LZSTAGE      0x20001400
+#define LZSTAGE_SIZE 0x400
+#define LZMBOX       0x20001C00
+
+void unlz ( unsigned char *dst, unsigned char *src, unsigned int len )
+{
+    unsigned char *end;
+    unsigned char *m;
+    unsigned int n;
+
+    end=src+len;
+    while(src<end)
+    {
+        n=*src++;
+        if(n&0x80)
+        {
+            n=(n&0x7F)+3;
+            m=dst-((src[0]|(src[1]<<8))+1);
+            src+=2;
+            while(n--) *dst++=*m++;
+        }
+        else
+        {
+            n++;
+            while(n--) *dst++=*src++;
+        }
+    }
+}
+
+int notmain ( void )
+{
+    unsigned int buf;
+    unsigned int len;
+
+    for(buf=0;;buf^=1)
+    {
+        while((len=GET32(LZMBOX+(buf<<3)+4))==0) continue;
+        unlz((unsigned char *)GET32(LZMBOX+(buf<<3)),(unsigned char *)(LZSTAGE+(buf*LZSTAGE_SIZE)),len);
+        PUT32(LZMBOX+(buf<<3)+4,0);
+    }
+    return(0);
+}